@@ -0,0 +1,703 @@
+/*
+ * bench.c - load generator for the gofish gopher/http daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * gofish-bench keeps up to -c requests in flight, one per connection,
+ * the way gopher works. Without -r each finished request is replaced
+ * at once (closed loop). With -r the requests are due at fixed times
+ * (open loop) and a request's latency is measured from when it was
+ * due, not from when a connection was free to send it. So a server
+ * that stalls is charged for the requests that queued up behind the
+ * stall, rather than those requests quietly not being sent.
+ *
+ * The requests come from -f, one per line, used in turn. A line that
+ * starts with GET or HEAD is sent as an http request, anything else
+ * as a gopher selector.
+ *
+ * With -l the requests come from a GoFish access log instead and are
+ * each sent once, due when the log says they arrived. The log only
+ * has seconds, so each second's requests are spread evenly over it.
+ * -s speeds the replay up. GoFish logs http requests with their
+ * HTTP/1.x version and gopher selectors without, which tells them
+ * apart. A line without the version is http if it has a referer and
+ * agent, or if -H is given. Binary logs can go through gofish-logcat
+ * -c first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "gofish.h"
+
+#define MAX_CLASSES		32
+
+struct req {
+	char *data;
+	int len;
+	int http;
+	int class;
+	long long at;        // replay offset in usecs
+};
+
+struct slot {
+	int sock;            // -1 if free
+	int connected;
+	struct req *req;
+	int sent;
+	long long due;       // when the request should have gone out
+	long long deadline;
+	char head[96];       // start of the reply, for the status
+	int head_len;
+	unsigned long long bytes;
+	unsigned long long nl; // just past the first '\n', 0 if none yet
+};
+
+// Latencies by protocol and file extension
+struct class {
+	char name[20];
+	struct hist lat;
+	unsigned long long n_ok, max_lat;
+	unsigned errors;
+};
+
+static struct req *reqs;
+static unsigned long long n_reqs;
+static int replay, http_log;
+static double scale = 1;
+
+static struct class classes[MAX_CLASSES];
+static int n_classes;
+
+static struct slot *slots;
+static struct pollfd *ufds;
+static int n_slots;
+
+static double rate;
+static long long t0, end;
+
+static struct hist lat;
+static unsigned long long n_ok, n_bytes, max_lat;
+static unsigned n_connect, n_write, n_read, n_timeout, n_status;
+static unsigned long long max_queued;
+
+
+static void *xalloc(void *p)
+{
+	if(!p) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+
+static int find_class(int http, char *path)
+{
+	char name[20], *p;
+	int i;
+
+	if(*path == '\0' || path[strlen(path) - 1] == '/')
+		p = "/";
+	else if((p = strrchr(path, '.')) == NULL || strchr(p, '/'))
+		p = "-";
+	snprintf(name, sizeof(name), "%s %s", http ? "http" : "gopher", p);
+	for(p = name; *p; ++p) *p = tolower(*p);
+
+	for(i = 0; i < n_classes; ++i)
+		if(strcmp(classes[i].name, name) == 0)
+			return i;
+
+	// the last one catches the rest
+	if(n_classes == MAX_CLASSES)
+		return MAX_CLASSES - 1;
+	strcpy(classes[n_classes].name,
+		   n_classes == MAX_CLASSES - 1 ? "other" : name);
+	return n_classes++;
+}
+
+
+/* host can be NULL. path has no leading slash, for gopher it is the
+ * selector.
+ */
+static struct req *add_req(int http, int head, char *host, char *path)
+{
+	struct req *r;
+	int len = strlen(path) + (host ? strlen(host) : 0) + 40;
+
+	if((n_reqs & 1023) == 0)
+		reqs = xalloc(realloc(reqs, (n_reqs + 1024) * sizeof(struct req)));
+	r = &reqs[n_reqs++];
+	memset(r, 0, sizeof(struct req));
+
+	// We read to EOF, so http is always 1.0
+	r->http = http;
+	r->class = find_class(http, path);
+	r->data = xalloc(malloc(len));
+	if(!http)
+		r->len = sprintf(r->data, "%s\r\n", path);
+	else if(host)
+		r->len = sprintf(r->data, "%s /%s HTTP/1.0\r\nHost: %s\r\n\r\n",
+						 head ? "HEAD" : "GET", path, host);
+	else
+		r->len = sprintf(r->data, "%s /%s HTTP/1.0\r\n\r\n",
+						 head ? "HEAD" : "GET", path);
+
+	return r;
+}
+
+
+static FILE *open_file(char *fname)
+{
+	FILE *fp;
+
+	if(strcmp(fname, "-") == 0)
+		return stdin;
+
+	if(!(fp = fopen(fname, "r"))) {
+		perror(fname);
+		exit(1);
+	}
+	return fp;
+}
+
+
+static char *chomp(char *line)
+{
+	line[strcspn(line, "\r\n")] = '\0';
+	return line;
+}
+
+
+static void read_reqs(char *fname)
+{
+	char line[MAX_LINE + 1], *p;
+	FILE *fp = open_file(fname);
+	int head;
+
+	while(fgets(line, sizeof(line), fp)) {
+		chomp(line);
+		if(*line == '#' || *line == '\0')
+			continue;
+
+		head = strncmp(line, "HEAD ", 5) == 0;
+		if(head || strncmp(line, "GET ", 4) == 0) {
+			for(p = line + 4 + head; *p == ' ' || *p == '/'; ++p) ;
+			p[strcspn(p, " ")] = '\0';
+			add_req(1, head, NULL, p);
+		} else
+			add_req(0, 0, NULL, line);
+	}
+
+	if(fp != stdin) fclose(fp);
+
+	if(n_reqs == 0) {
+		printf("%s: no requests\n", fname);
+		exit(1);
+	}
+}
+
+
+// The zone is the same for the whole log, so we ignore it
+static time_t log_time(char *date)
+{
+	static char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char mon[4], *p;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(date, "%d/%3s/%d:%d:%d:%d", &tm.tm_mday, mon, &tm.tm_year,
+			  &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+	   (p = strstr(months, mon)) == NULL)
+		return -1;
+	tm.tm_mon = (p - months) / 3;
+	tm.tm_year -= 1900;
+
+	return timegm(&tm);
+}
+
+
+/* Parses a line written by log_hit:
+ *   addr - - [date] "GET host/selector[ HTTP/1.x]" status length
+ *     ["referer" "agent"]
+ * Returns 0 if it is not one.
+ */
+static int log_line(char *line, time_t *t)
+{
+	char *p, *e, *host = NULL;
+	unsigned status, length;
+	int http, head, n;
+
+	if(!(p = strchr(line, '[')) || (*t = log_time(p + 1)) == -1)
+		return 0;
+	if(!(p = strstr(p, "] \"")))
+		return 0;
+	p += 3;
+
+	head = strncmp(p, "HEAD ", 5) == 0;
+	if(!head && strncmp(p, "GET ", 4))
+		return 0;
+	p += head ? 5 : 4;
+
+	// The selector is not escaped, it ends at the " before the status
+	for(e = p; (e = strchr(e, '"')); ++e) {
+		n = -1;
+		if(sscanf(e, "\" %u %u%n", &status, &length, &n) == 2 && n > 0 &&
+		   (e[n] == '\0' || e[n] == ' '))
+			break;
+	}
+	if(!e)
+		return 0;
+
+	// log_hit logs http requests with their version, gopher without
+	if(e - p > 9 && strncmp(e - 9, " HTTP/1.", 8) == 0 &&
+	   (e[-1] == '0' || e[-1] == '1')) {
+		http = 1;
+		e -= 9;
+	} else
+		http = http_log || e[n] == ' ';
+	*e = '\0';
+
+	if(*p != '/') {
+		host = p;
+		if(!(p = strchr(p, '/')))
+			return 0;
+		*p = '\0';
+	}
+	++p;
+
+	// Any other version, for a line that is http without one of ours
+	if(http)
+		p[strcspn(p, " ")] = '\0';
+	else if(strcmp(p, "[Empty]") == 0)
+		*p = '\0';
+
+	add_req(http, head, http ? host : NULL, p);
+	return 1;
+}
+
+
+static void read_log(char *fname)
+{
+	char line[4096];
+	FILE *fp = open_file(fname);
+	time_t t, first = -1, last = -1;
+	unsigned long long i, j, run = 0, bad = 0;
+
+	while(fgets(line, sizeof(line), fp)) {
+		if(!log_line(chomp(line), &t)) {
+			++bad;
+			continue;
+		}
+		if(first == -1) first = last = t;
+		if(t < last) t = last; // threads can log out of order
+		reqs[n_reqs - 1].at = t - first;
+		last = t;
+	}
+
+	if(fp != stdin) fclose(fp);
+
+	if(n_reqs == 0) {
+		printf("%s: no requests\n", fname);
+		exit(1);
+	}
+	if(bad)
+		printf("%s: skipped %llu lines\n", fname, bad);
+
+	// Spread each second out, then apply the scale
+	for(i = 1; i <= n_reqs; ++i)
+		if(i == n_reqs || reqs[i].at != reqs[run].at) {
+			for(j = run; j < i; ++j)
+				reqs[j].at = (reqs[j].at * 1000000 +
+							  (j - run) * 1000000 / (i - run)) / scale;
+			run = i;
+		}
+
+	replay = 1;
+}
+
+
+// When request k is due, or -1 if there are no more
+static long long due_at(unsigned long long k, long long now)
+{
+	long long due;
+
+	if(replay)
+		return k < n_reqs ? t0 + reqs[k].at : -1;
+	if(rate) {
+		due = t0 + (long long)(k * 1e6 / rate);
+		return due < end ? due : -1;
+	}
+	return now < end ? now : -1;
+}
+
+
+// How many requests are due but have no connection yet
+static unsigned long long queued(unsigned long long started, long long now)
+{
+	unsigned long long lo = started, hi = n_reqs, mid;
+
+	if(replay) {
+		while(lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if(t0 + reqs[mid].at <= now)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo - started;
+	}
+
+	if(rate) {
+		if(now >= end) now = end - 1;
+		hi = (unsigned long long)((now - t0) * rate / 1e6) + 1;
+		return hi > started ? hi - started : 0;
+	}
+
+	return 0;
+}
+
+
+static void finish(struct slot *s, unsigned *error)
+{
+	struct class *c = &classes[s->req->class];
+	long long usecs = hist_clock() - s->due;
+
+	if(error) {
+		++*error;
+		++c->errors;
+	} else {
+		++n_ok;
+		n_bytes += s->bytes;
+		hist_add(&lat, usecs);
+		if(usecs > max_lat) max_lat = usecs;
+		++c->n_ok;
+		hist_add(&c->lat, usecs);
+		if(usecs > c->max_lat) c->max_lat = usecs;
+	}
+
+	close(s->sock);
+	s->sock = -1;
+}
+
+
+static void start(struct slot *s, struct req *r, long long due,
+				  int port, unsigned addr, int timeout)
+{
+	memset(s, 0, sizeof(struct slot));
+	s->req = r;
+	s->due = due;
+	s->deadline = hist_clock() + timeout * 1000000LL;
+
+	if((s->sock = connect_start(port, addr)) < 0) {
+		s->sock = -1;
+		++n_connect;
+		++classes[r->class].errors;
+	}
+}
+
+
+// The reply is all in, is it an error?
+static int reply_ok(struct slot *s)
+{
+	s->head[s->head_len] = '\0';
+
+	if(s->req->http) {
+		int status = http_status(s->head);
+		return status >= 200 && status < 400;
+	}
+
+	/* gopher errors are one line starting with 3. It can be longer
+	 * than head, it holds the selector.
+	 */
+	return s->nl != s->bytes || gopher_status(s->head) == 0;
+}
+
+
+static void do_slot(struct slot *s)
+{
+	char buf[64 * 1024], *p;
+	int n, err;
+	socklen_t len;
+
+	if(!s->connected) {
+		len = sizeof(err);
+		if(getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			finish(s, &n_connect);
+			return;
+		}
+		s->connected = 1;
+	}
+
+	if(s->sent < s->req->len) {
+		n = write(s->sock, s->req->data + s->sent, s->req->len - s->sent);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EINTR) finish(s, &n_write);
+			return;
+		}
+		s->sent += n;
+		return;
+	}
+
+	while((n = read(s->sock, buf, sizeof(buf))) > 0) {
+		if(!s->nl && (p = memchr(buf, '\n', n)))
+			s->nl = s->bytes + (p - buf) + 1;
+		if(s->head_len < sizeof(s->head) - 1) {
+			int c = sizeof(s->head) - 1 - s->head_len;
+			if(c > n) c = n;
+			memcpy(s->head + s->head_len, buf, c);
+			s->head_len += c;
+		}
+		s->bytes += n;
+	}
+
+	if(n == 0)
+		finish(s, reply_ok(s) ? NULL : &n_status);
+	else if(errno != EAGAIN && errno != EINTR)
+		finish(s, &n_read);
+}
+
+
+/* The mmap cache counters from STATS: hits, misses, ghost hits and
+ * evictions. STATS leaves them out while they are zero. Returns 0 if
+ * there are none.
+ */
+static int cache_stats(int port, unsigned addr, unsigned *v)
+{
+	static char *names[] = {
+		"Cache hits:", "Cache misses:", "Ghost hits:", "Evictions:"
+	};
+	char buf[16 * 1024], *p;
+	int sock, n, len = 0, i;
+
+	memset(v, 0, 4 * sizeof(unsigned));
+
+	if((sock = connect_socket(port, addr)) < 0)
+		return 0;
+	if(write(sock, "STATS\r\n", 7) != 7) {
+		close(sock);
+		return 0;
+	}
+	while(len < sizeof(buf) - 1 &&
+		  (n = read(sock, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	close(sock);
+	buf[len] = '\0';
+
+	for(i = 0; i < 4; ++i) {
+		if(!(p = strstr(buf, names[i])))
+			return 0;
+		v[i] = strtoul(p + strlen(names[i]), NULL, 10);
+	}
+
+	return 1;
+}
+
+
+// The buckets round up, but never past what we saw
+static unsigned long long percentile(struct hist *h, unsigned per_mille,
+									 unsigned long long max)
+{
+	unsigned long long v = hist_value(h, per_mille);
+
+	return v < max ? v : max;
+}
+
+
+static void usage(char *prog)
+{
+	printf("usage: %s [-c conns] [-r rate] [-d secs] [-f reqfile] [-p port]\n"
+		   "\t[-t timeout] [host]\n"
+		   "       %s -l logfile [-s scale] [-H] [-c conns] [-p port]\n"
+		   "\t[-t timeout] [host]\n", prog, prog);
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *hostname = "localhost", *reqfile = NULL, *logfile = NULL;
+	int port = GOPHER_PORT, duration = 10, timeout = 30;
+	unsigned addr, before[4], after[4];
+	unsigned long long started = 0, q;
+	long long now, due;
+	int c, i, n, active, n_free, wait;
+	double secs;
+
+	n_slots = 10;
+
+	while((c = getopt(argc, argv, "c:d:f:Hl:p:r:s:t:")) != -1)
+		switch(c) {
+		case 'c': n_slots = strtol(optarg, 0, 0); break;
+		case 'd': duration = strtol(optarg, 0, 0); break;
+		case 'f': reqfile = optarg; break;
+		case 'H': http_log = 1; break;
+		case 'l': logfile = optarg; break;
+		case 'p': port = strtol(optarg, 0, 0); break;
+		case 'r': rate = strtod(optarg, 0); break;
+		case 's': scale = strtod(optarg, 0); break;
+		case 't': timeout = strtol(optarg, 0, 0); break;
+		default: usage(*argv);
+		}
+	if(optind < argc) hostname = argv[optind];
+	if(n_slots < 1 || duration < 1 || timeout < 1 || rate < 0 || scale <= 0 ||
+	   (logfile && (reqfile || rate)))
+		usage(*argv);
+
+	if(logfile)
+		read_log(logfile);
+	else if(reqfile)
+		read_reqs(reqfile);
+	else
+		add_req(0, 0, NULL, ""); // the root menu
+
+	if((addr = gethostaddr(hostname)) == 0) {
+		printf("%s unknown host\n", hostname);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	slots = xalloc(calloc(n_slots, sizeof(struct slot)));
+	ufds = xalloc(calloc(n_slots, sizeof(struct pollfd)));
+	for(i = 0; i < n_slots; ++i)
+		slots[i].sock = -1;
+
+	cache_stats(port, addr, before);
+
+	t0 = hist_clock();
+	end = t0 + duration * 1000000LL;
+
+	while(1) {
+		now = hist_clock();
+
+		// Start what is due
+		for(i = 0; i < n_slots; ++i)
+			if(slots[i].sock == -1) {
+				if((due = due_at(started, now)) < 0 || due > now)
+					break;
+				start(&slots[i], &reqs[replay ? started : started % n_reqs],
+					  due, port, addr, timeout);
+				++started;
+			}
+		if((q = queued(started, now)) > max_queued)
+			max_queued = q;
+
+		for(n_free = 0, active = 0, i = 0; i < n_slots; ++i) {
+			struct slot *s = &slots[i];
+
+			if(s->sock != -1 && now > s->deadline)
+				finish(s, &n_timeout);
+			if(s->sock == -1) {
+				++n_free;
+				continue;
+			}
+			ufds[active].fd = s->sock;
+			ufds[active].events = s->connected && s->sent == s->req->len ?
+				POLLIN : POLLOUT;
+			ufds[active].revents = 0;
+			++active;
+		}
+
+		due = due_at(started, now);
+		if(active == 0 && due < 0) break;
+
+		// Wake for the next due request if we can send it, else every 100ms
+		wait = 100;
+		if(n_free && due >= 0 && due - now < wait * 1000LL)
+			wait = due > now ? (due - now + 999) / 1000 : 0;
+
+		if((n = poll(ufds, active, wait)) < 0) {
+			if(errno == EINTR) continue;
+			perror("poll");
+			exit(1);
+		}
+
+		for(active = 0, i = 0; n > 0 && i < n_slots; ++i) {
+			struct slot *s = &slots[i];
+
+			if(s->sock == -1 || ufds[active].fd != s->sock) continue;
+			if(ufds[active++].revents) {
+				do_slot(s);
+				--n;
+			}
+		}
+	}
+
+	secs = (hist_clock() - t0) / 1e6;
+
+	printf("Requests:   %llu ok, %u errors\n", n_ok,
+		   n_connect + n_write + n_read + n_timeout + n_status);
+	if(n_connect + n_write + n_read + n_timeout + n_status)
+		printf("Errors:     connect %u, write %u, read %u, timeout %u, "
+			   "status %u\n", n_connect, n_write, n_read, n_timeout, n_status);
+	if(rate)
+		printf("Rate:       %.0f/s asked, %llu sent in %d s\n",
+			   rate, started, duration);
+	if(replay)
+		printf("Replay:     %llu requests over %.2f s at %gx\n",
+			   n_reqs, reqs[n_reqs - 1].at / 1e6, scale);
+	if(max_queued)
+		printf("Queued:     %llu at most, waiting for a connection\n",
+			   max_queued);
+	printf("Throughput: %.0f req/s, %.2f MB/s over %.2f s\n",
+		   n_ok / secs, n_bytes / secs / (1024 * 1024), secs);
+	if(n_ok)
+		printf("Latency us: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+			   percentile(&lat, 500, max_lat), percentile(&lat, 900, max_lat),
+			   percentile(&lat, 990, max_lat), percentile(&lat, 999, max_lat),
+			   max_lat);
+
+	if(n_classes > 1) {
+		printf("\n%-16s %8s %6s %8s %8s %8s %8s %8s\n", "Latency us",
+			   "ok", "errors", "p50", "p90", "p99", "p99.9", "max");
+		for(i = 0; i < n_classes; ++i) {
+			struct class *c = &classes[i];
+
+			printf("%-16s %8llu %6u", c->name, c->n_ok, c->errors);
+			if(c->n_ok)
+				printf(" %8llu %8llu %8llu %8llu %8llu",
+					   percentile(&c->lat, 500, c->max_lat),
+					   percentile(&c->lat, 900, c->max_lat),
+					   percentile(&c->lat, 990, c->max_lat),
+					   percentile(&c->lat, 999, c->max_lat), c->max_lat);
+			putchar('\n');
+		}
+	}
+
+	if(cache_stats(port, addr, after)) {
+		unsigned hits = after[0] - before[0], misses = after[1] - before[1];
+
+		printf("\nCache:      %u hits, %u misses, %.1f%% hit rate\n"
+			   "            %u ghost hits, %u evictions\n",
+			   hits, misses,
+			   hits + misses ? hits * 100.0 / (hits + misses) : 0.0,
+			   after[2] - before[2], after[3] - before[3]);
+	}
+
+	return n_ok == 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * client.c - client side helpers for webtest and gofish-bench
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "gofish.h"
+
+
+/* The status of a gopher reply: 0 for success, the [code] of a GoFish
+ * error, or 3 for other errors.
+ */
+int gopher_status(char *buf)
+{
+	char *p, *e;
+	int n;
+
+	if(*buf == '3') {
+		if((p = strchr(buf, '['))) {
+			++p;
+			n = strtol(p, &e, 10);
+			if(*e == ']') return n;
+		}
+		// default
+		return 3;
+	}
+
+	return 0;
+}
+
+
+// The status of an http reply, or -1 if it is not one
+int http_status(char *buf)
+{
+	int status;
+
+	if(strncmp(buf, "HTTP/1.1 ", 9) &&
+	   strncmp(buf, "HTTP/1.0 ", 9))
+		return -1;
+
+	status = strtol(buf + 9, 0, 10);
+
+	if(status < 100 || status >= 600)
+		return -1;
+
+	return status;
+}
+
+
+int gopher_reply(int sock, char *buf, int size)
+{
+	int n;
+
+	n = read(sock, buf, size - 1);
+	close(sock);
+
+	if(n <= 0) {
+		perror("read");
+		return -1;
+	}
+	buf[n] = '\0';
+
+	return gopher_status(buf);
+}
+
+
+int http_reply(int sock, char *buf, int size)
+{
+	int n;
+
+	n = read(sock, buf, size - 1);
+	close(sock);
+
+	if(n <= 0) {
+		perror("read");
+		return -1;
+	}
+	buf[n] = '\0';
+
+	if((n = http_status(buf)) < 0)
+		printf("Bad status\n");
+	return n;
+}
+
+
+static int do_connect(int port, unsigned addr, int nonblock)
+{
+	struct sockaddr_in sock_name;
+	int sock;
+
+#undef socket
+	if((sock = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if(nonblock && fcntl(sock, F_SETFL, O_NONBLOCK)) {
+		close(sock);
+		return -1;
+	}
+
+	memset(&sock_name, 0, sizeof(sock_name));
+	sock_name.sin_family = AF_INET;
+	sock_name.sin_addr.s_addr = addr;
+	sock_name.sin_port = htons(port);
+
+	if(connect(sock, (struct sockaddr *)&sock_name, sizeof(sock_name)) &&
+	   !(nonblock && errno == EINPROGRESS)) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+int connect_socket(int port, unsigned addr)
+{
+	return do_connect(port, addr, 0);
+}
+
+
+// Non-blocking, the connect finishes when the socket is writable
+int connect_start(int port, unsigned addr)
+{
+	return do_connect(port, addr, 1);
+}
+
+
+unsigned gethostaddr(char *hostname)
+{
+	struct hostent *host;
+
+	if((host = gethostbyname(hostname)) == NULL)
+		return 0;
+
+	return *(unsigned *)host->h_addr_list[0];
+}
@@ -47,10 +47,32 @@ int   icon_width    = ICON_WIDTH;
 int   icon_height   = ICON_HEIGHT;
 int   virtual_hosts = 0;
 int   combined_log  = 0;
+int   binary_log    = 0;
 int   is_gopher     = 1;
 int   htmlizer      = 1;
+char *metrics_path  = NULL;
 int   max_conns     = 25;
 int   process_cache = 0;
+int   workers       = 1;
+int   threads       = 1;
+int   read_timeout  = READ_TIMEOUT;
+int   write_timeout = WRITE_TIMEOUT;
+int   cgi_timeout   = CGI_TIMEOUT;
+int   sendfile_threshold = SENDFILE_THRESHOLD;
+int   keepalive_timeout  = KEEPALIVE_TIMEOUT;
+int   keepalive_max      = KEEPALIVE_MAX;
+unsigned long mmap_cache_bytes = 0;
+unsigned long mmap_cache_rss   = 0;
+int   mmap_cache_pressure = MMAP_CACHE_PRESSURE;
+int   mmap_cache_policy   = MMAP_LRU;
+int   selector_cache_ttl  = SELECTOR_CACHE_TTL;
+int   selector_cache_size = SELECTOR_CACHE_SIZE;
+int   menu_cache_size     = MENU_CACHE_SIZE;
+int   log_async           = 0;
+unsigned long log_buffer_size = LOG_BUFFER_SIZE;
+int   log_flush_interval  = LOG_FLUSH_INTERVAL;
+unsigned long log_flush_size  = LOG_FLUSH_SIZE;
+int   log_full            = LOG_DROP;
 
 
 extern void set_mime_file(char *fname);
@@ -78,6 +100,23 @@ void must_strtol(char *str, int *value)
 }
 
 
+// Like must_strtol but allows a k, m, or g suffix
+void must_strtosize(char *str, unsigned long *value)
+{
+	char *end;
+	unsigned long n = strtoul(str, &end, 0);
+
+	if(str == end) return;
+
+	switch(tolower((int)*end)) {
+	case 'g': n <<= 10; // fall thru
+	case 'm': n <<= 10; // fall thru
+	case 'k': n <<= 10;
+	}
+	*value = n;
+}
+
+
 char *must_alloc(int size)
 {
 	char *mem;
@@ -165,7 +204,28 @@ int read_config(char *fname)
 				must_strtol(p, &virtual_hosts);
 			else if(strcmp(line, "combined-log") == 0)
 				must_strtol(p, &combined_log);
-			else if(strcmp(line, "is-http") == 0) {
+			else if(strcmp(line, "binary-log") == 0)
+				must_strtol(p, &binary_log);
+			else if(strcmp(line, "log-async") == 0) {
+#ifdef THREADS
+				must_strtol(p, &log_async);
+#else
+				printf("Async logging needs threads\n");
+#endif
+			} else if(strcmp(line, "log-buffer-size") == 0)
+				must_strtosize(p, &log_buffer_size);
+			else if(strcmp(line, "log-flush-interval") == 0)
+				must_strtol(p, &log_flush_interval);
+			else if(strcmp(line, "log-flush-size") == 0)
+				must_strtosize(p, &log_flush_size);
+			else if(strcmp(line, "log-full") == 0) {
+				if(strcasecmp(p, "drop") == 0)
+					log_full = LOG_DROP;
+				else if(strcasecmp(p, "block") == 0)
+					log_full = LOG_BLOCK;
+				else
+					printf("Unknown log-full '%s'\n", p);
+			} else if(strcmp(line, "is-http") == 0) {
 				int is_http = -1;
 				must_strtol(p, &is_http);
 				if(is_http != -1) is_gopher = !is_http;
@@ -174,6 +234,29 @@ int read_config(char *fname)
 				extern int mmap_cache_size;
 				must_strtol(p, &mmap_cache_size);
 #endif
+			} else if(strcmp(line, "mmap-cache-bytes") == 0)
+				must_strtosize(p, &mmap_cache_bytes);
+			else if(strcmp(line, "mmap-cache-rss") == 0)
+				must_strtosize(p, &mmap_cache_rss);
+			else if(strcmp(line, "mmap-cache-pressure") == 0)
+				must_strtol(p, &mmap_cache_pressure);
+			else if(strcmp(line, "mmap-cache-policy") == 0) {
+				if(strcasecmp(p, "lru") == 0)
+					mmap_cache_policy = MMAP_LRU;
+				else if(strcasecmp(p, "2q") == 0)
+					mmap_cache_policy = MMAP_2Q;
+				else
+					printf("Unknown mmap-cache-policy '%s'\n", p);
+			} else if(strcmp(line, "selector-cache-ttl") == 0)
+				must_strtol(p, &selector_cache_ttl);
+			else if(strcmp(line, "selector-cache-size") == 0)
+				must_strtol(p, &selector_cache_size);
+			else if(strcmp(line, "menu-cache-size") == 0)
+				must_strtol(p, &menu_cache_size);
+			else if(strcmp(line, "metrics-path") == 0) {
+				if(metrics_path) free(metrics_path);
+				if(*p == '/') ++p;
+				metrics_path = must_strdup(p);
 			} else if(strcmp(line, "htmlize") == 0)
 				must_strtol(p, &htmlizer);
 			else if(strcmp(line, "max-connections") == 0)
@@ -184,6 +267,34 @@ int read_config(char *fname)
 				http_set_header(p, 0);
 			else if(strcmp(line, "preprocess-cache") == 0)
 				must_strtol(p, &process_cache);
+			else if(strcmp(line, "workers") == 0)
+				must_strtol(p, &workers);
+			else if(strcmp(line, "threads") == 0) {
+#ifdef THREADS
+				must_strtol(p, &threads);
+#else
+				printf("Threads not configured\n");
+#endif
+			} else if(strcmp(line, "reuseport") == 0) {
+				int on = 0;
+				must_strtol(p, &on);
+				set_reuseport(on);
+			} else if(strcmp(line, "read-timeout") == 0)
+				must_strtol(p, &read_timeout);
+			else if(strcmp(line, "write-timeout") == 0)
+				must_strtol(p, &write_timeout);
+			else if(strcmp(line, "cgi-timeout") == 0)
+				must_strtol(p, &cgi_timeout);
+			else if(strcmp(line, "sendfile-threshold") == 0) {
+#ifdef USE_SENDFILE
+				must_strtol(p, &sendfile_threshold);
+#else
+				printf("sendfile not supported\n");
+#endif
+			} else if(strcmp(line, "keepalive-timeout") == 0)
+				must_strtol(p, &keepalive_timeout);
+			else if(strcmp(line, "keepalive-max") == 0)
+				must_strtol(p, &keepalive_max);
 			else
 				printf("Unknown config '%s'\n", line);
 		}
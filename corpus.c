@@ -0,0 +1,258 @@
+/*
+ * corpus.c - builds a synthetic gopher tree for benchmarking gofish
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * gofish-corpus makes a tree of directories -f wide and -d deep with
+ * -n files in each, plus a directory called huge with -H files of the
+ * minimum size. File sizes are log uniform between -z min:max, so
+ * small files are common and big ones rare, and the extensions cycle
+ * through the common types. The .cache files are written by the same
+ * code as mkcache -r.
+ *
+ * The same arguments and -s seed always give the same tree. The
+ * selectors are printed on stdout, read back from the .cache files,
+ * in the gofish-bench -f format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "gofish.h"
+
+
+int mmap_cache_size; // needed by config
+
+static int depth = 2, fanout = 4, n_files = 20, n_huge;
+static unsigned long min_size = 100, max_size = 256 * 1024;
+static int http_sels;
+
+// The first three are text
+static char *exts[] = { ".txt", ".html", "", ".gif", ".jpg", ".zip", ".gz" };
+#define N_EXTS	(sizeof(exts) / sizeof(char *))
+
+static char buf[64 * 1024];
+static unsigned long long seed = 1;
+
+// The dirs we made, to read the .cache files back
+static char **dirs;
+static int n_dirs;
+
+
+// xorshift64*, so the tree does not depend on the libc
+static unsigned long long rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+
+/* Log uniform between min_size and max_size: pick a power of two,
+ * then a size within it.
+ */
+static unsigned long file_size(void)
+{
+	int lo = 63 - __builtin_clzll(min_size);
+	int hi = 63 - __builtin_clzll(max_size);
+	int b = lo + rnd() % (hi - lo + 1);
+	unsigned long size = (1UL << b) + rnd() % (1UL << b);
+
+	if(size < min_size) return min_size;
+	if(size > max_size) return max_size;
+	return size;
+}
+
+
+static void make_file(char *path, int i, unsigned long size)
+{
+	char fname[PATH_MAX];
+	unsigned long n;
+	int j, binary;
+	FILE *fp;
+
+	snprintf(fname, sizeof(fname), "%s/f%04d%s", path, i, exts[i % N_EXTS]);
+	binary = i % N_EXTS >= 3;
+
+	if(!(fp = fopen(fname, "w"))) {
+		perror(fname);
+		exit(1);
+	}
+
+	while(size > 0) {
+		n = size > sizeof(buf) ? sizeof(buf) : size;
+		if(binary)
+			for(j = 0; j < n; ++j)
+				buf[j] = rnd();
+		else
+			for(j = 0; j < n; ++j)
+				buf[j] = j % 64 == 63 ? '\n' : 'a' + rnd() % 26;
+		if(fwrite(buf, n, 1, fp) != 1) {
+			perror(fname);
+			exit(1);
+		}
+		size -= n;
+	}
+
+	if(fclose(fp)) {
+		perror(fname);
+		exit(1);
+	}
+}
+
+
+static void make_dir(char *path)
+{
+	if(mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		exit(1);
+	}
+
+	if(!(dirs = realloc(dirs, (n_dirs + 1) * sizeof(char *)))) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	dirs[n_dirs++] = must_strdup(path);
+}
+
+
+static void make_tree(char *path, int level)
+{
+	char sub[PATH_MAX];
+	int i;
+
+	make_dir(path);
+
+	for(i = 0; i < n_files; ++i)
+		make_file(path, i, file_size());
+
+	if(level < depth)
+		for(i = 0; i < fanout; ++i) {
+			snprintf(sub, sizeof(sub), "%s/d%d", path, i);
+			make_tree(sub, level + 1);
+		}
+}
+
+
+// Prints the selectors in each .cache
+static void print_selectors(void)
+{
+	char fname[PATH_MAX], line[MAX_LINE + 1], *sel, *e;
+	FILE *fp;
+	int i;
+
+	for(i = 0; i < n_dirs; ++i) {
+		snprintf(fname, sizeof(fname), "%s/.cache", dirs[i]);
+		if(!(fp = fopen(fname, "r"))) {
+			perror(fname);
+			exit(1);
+		}
+
+		while(fgets(line, sizeof(line), fp))
+			if((sel = strchr(line, '\t')) && (e = strchr(++sel, '\t'))) {
+				*e = '\0';
+				if(http_sels)
+					printf("GET /%s\n", sel);
+				else
+					printf("%s\n", sel);
+			}
+
+		fclose(fp);
+	}
+}
+
+
+static void usage(char *prog)
+{
+	printf("usage: %s [-iw] [-c config] [-d depth] [-f fanout] "
+		   "[-n files]\n\t[-H huge] [-s seed] [-z min:max] dir\n", prog);
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *config = GOPHER_CONFIG, *p;
+	int c, i;
+
+	while((c = getopt(argc, argv, "c:d:f:H:in:s:wz:")) != -1)
+		switch(c) {
+		case 'c': config = optarg; break;
+		case 'd': depth = strtol(optarg, 0, 0); break;
+		case 'f': fanout = strtol(optarg, 0, 0); break;
+		case 'H': n_huge = strtol(optarg, 0, 0); break;
+		case 'i': make_idx = 1; break;
+		case 'n': n_files = strtol(optarg, 0, 0); break;
+		case 's': seed = strtoull(optarg, 0, 0); break;
+		case 'w': http_sels = 1; break;
+		case 'z':
+			if((p = strchr(optarg, ':'))) {
+				*p++ = '\0';
+				must_strtosize(p, &max_size);
+			}
+			must_strtosize(optarg, &min_size);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if(optind != argc - 1 || depth < 0 || fanout < 0 || n_files < 0 ||
+	   n_huge < 0 || min_size < 1 || max_size < min_size)
+		usage(*argv);
+	if(seed == 0) seed = 1;
+
+	// For the hostname and port in the .cache files
+	read_config(config);
+	mime_init();
+
+	if(mkdir(argv[optind], 0755) && errno != EEXIST) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if(chdir(argv[optind])) {
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	make_tree(".", 0);
+
+	if(n_huge) {
+		make_dir("huge");
+		for(i = 0; i < n_huge; ++i)
+			make_file("huge", i, min_size);
+	}
+
+	recurse = 1;
+	process_dir(".", 0);
+
+	print_selectors();
+
+	return 0;
+}
+
+
+/* Dummy functions for config */
+void set_listen_address(char *addr) {}
+void set_reuseport(int on) {}
+void http_set_header(char *fname, int header) {}
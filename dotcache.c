@@ -0,0 +1,827 @@
+/*
+ * dotcache.c - writes the .cache files for mkcache and gofish-corpus
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XEmacs; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
+#include "gofish.h"
+
+
+int verbose = 0;
+int recurse = 0;
+int sorttype = 0;
+int make_idx = 0;
+int jobs = 1;
+
+/* Files are written under a temp name and renamed into place, so the
+ * server never sees half of one. The temp name has the -j worker in
+ * it, two workers may be writing the same directory.
+ */
+static THREAD_LOCAL int worker_n;
+static int replace_file(char *tmpname, char *fname);
+
+/*
+ * TODO
+ *   + does not work except from root dir
+ *   + does not look at extensions
+ *   + recursive
+ *   - does not handle symbolic links correctly
+ *     - does not know if they are dirs or files
+ *   - empty dirs are a problem if non-recursive
+ *   - needs a config file
+ *   - read .names
+ *   - read .links
+ *   - read .ignore
+ *   - if a directory .cache can not be created,
+ *     we still get the entry in the upper layer
+ */
+
+
+struct extension {
+	char *ext;
+	char type;
+	int binary;
+} exts[] = {
+	{ "txt",	'0', 0 },
+	{ "html",	'h', 0 },
+	{ "htm",	'h', 0 },
+	{ "gif",	'I', 1 },
+	{ "jpg",	'I', 1 },
+	{ "png",	'I', 1 },
+	{ "jpeg",	'I', 1 },
+	{ "gz",		'9', 1 },
+	{ "tgz",	'9', 1 },
+	{ "tar",	'9', 1 },
+	{ "rpm",	'9', 1 },
+	{ "zip",	'9', 1 },
+	{ "Z",		'9', 1 },
+	{ "pdf",	'9', 1 },
+	{ "ogg",	'9', 1 },
+	{ "mp3",	'9', 1 },
+};
+#define N_EXTS	(sizeof(exts) / sizeof(struct extension))
+
+struct entry {
+	char *name;
+	char type;
+	char ftype;
+};
+
+int read_dir(struct entry **entries, char *path, int level);
+#ifdef THREADS
+static void pool_push(char *path, int level, int pos);
+#endif
+int output_dir(struct entry *entries, int n, char *path, int level);
+int output_idx(struct entry *entries, int n, char *path, int level);
+
+
+/* 0 */
+int simple_compare(const void *a, const void *b)
+{
+	return strcmp(((struct entry *)a)->name, ((struct entry *)b)->name);
+}
+
+/* 1 */
+int dirs_compare(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	if(ea->ftype == '1') {
+		if(eb->ftype == '1')
+			return strcmp(ea->name, eb->name);
+		else
+			return -1;
+	}
+	if(eb->ftype == '1')
+		return 1;
+
+	return strcmp(ea->name, eb->name);
+}
+
+/* 2 */
+int dirs_type_compare(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+	int t;
+
+	if(ea->ftype == '1') {
+		if(eb->ftype == '1')
+			return strcmp(ea->name, eb->name);
+		else
+			return -1;
+	}
+	if(eb->ftype == '1')
+		return 1;
+
+	if((t = ea->type - eb->type) == 0)
+		return strcmp(ea->name, eb->name);
+	else
+		return t;
+}
+
+
+static void free_entries(struct entry *entries, int nentries)
+{
+	struct entry *entry;
+	int i;
+
+	for(entry = entries, i = 0; i < nentries; ++i, ++entry)
+		free(entry->name);
+	free(entries);
+}
+
+
+// Returns the number of entries in the .cache file
+int process_dir(char *path, int level)
+{
+	int nfiles;
+	struct entry *entries = NULL;
+
+	if(verbose) printf("Processing [%d] %s\n", level, path);
+
+	if((nfiles = read_dir(&entries, path, level)) == 0)
+		return 0;
+
+	switch(sorttype) {
+	default:
+		printf("Unsupported sorttype %d\n", sorttype);
+		// fall thru
+	case 0:
+		qsort(entries, nfiles, sizeof(struct entry), simple_compare);
+		break;
+	case 1:
+		qsort(entries, nfiles, sizeof(struct entry), dirs_compare);
+		break;
+	case 2:
+		qsort(entries, nfiles, sizeof(struct entry), dirs_type_compare);
+		break;
+	}
+
+	output_dir(entries, nfiles, path, level);
+
+	free_entries(entries, nfiles);
+
+	return nfiles;
+}
+
+
+int output_dir(struct entry *entries, int n, char *path, int level)
+{
+	FILE *fp;
+	char fname[PATH_MAX], tmpname[PATH_MAX];
+	struct entry *e;
+	int i, ok;
+
+	sprintf(fname, "%s/.cache", path);
+	sprintf(tmpname, "%s/.cache.tmp%d", path, worker_n);
+
+	if(!(fp = fopen(tmpname, "w"))) {
+		perror(path ? path : "root");
+		return 0;
+	}
+
+	for(e = entries, i = 0; i < n; ++i, ++e)
+		if(process_cache) {
+			if(level == 0)
+				fprintf(fp, "%c%s\t%c/%s\n",
+						e->type, e->name, e->ftype, e->name);
+			else
+				fprintf(fp, "%c%s\t%c/%s/%s\n",
+						e->type, e->name, e->ftype, path, e->name);
+		} else {
+			if(level == 0)
+				fprintf(fp, "%c%s\t%c/%s\t%s\t%d\n",
+						e->type, e->name, e->ftype, e->name, hostname, port);
+			else
+				fprintf(fp, "%c%s\t%c/%s/%s\t%s\t%d\n",
+						e->type, e->name, e->ftype, path, e->name, hostname, port);
+		}
+
+	ok = !ferror(fp);
+	if(fclose(fp)) ok = 0;
+	if(!ok || replace_file(tmpname, fname)) {
+		perror(fname);
+		unlink(tmpname);
+		return 0;
+	}
+
+	if(make_idx)
+		output_idx(entries, n, path, level);
+	else {
+		// An old one would be stale
+		strcat(fname, ".idx");
+		if(unlink(fname) && errno != ENOENT)
+			perror(fname);
+	}
+
+	return n;
+}
+
+
+static THREAD_LOCAL char *idx_base; // for idx_compare
+
+static int idx_compare(const void *a, const void *b)
+{
+	const struct idx_sel *sa = a, *sb = b;
+	int n;
+
+	n = memcmp(idx_base + sa->off, idx_base + sb->off,
+			   sa->len < sb->len ? sa->len : sb->len);
+	return n ? n : (int)sa->len - (int)sb->len;
+}
+
+
+/* Writes the .cache.idx for the .cache output_dir just wrote. See
+ * gofish.h for the format.
+ */
+int output_idx(struct entry *entries, int n, char *path, int level)
+{
+	FILE *fp;
+	char fname[PATH_MAX], tmpname[PATH_MAX];
+	struct idx_header *h;
+	struct idx_sel *sels;
+	struct stat sbuf;
+	struct entry *e;
+	char *image, *p;
+	size_t size;
+	int i, ok, plen = level ? strlen(path) + 1 : 0;
+
+	sprintf(fname, "%s/.cache", path);
+	if(stat(fname, &sbuf)) {
+		perror(fname);
+		return 0;
+	}
+
+	// The menu lines, plus room to align the selectors
+	size = sizeof(struct idx_header) + sizeof(unsigned);
+	for(e = entries, i = 0; i < n; ++i, ++e)
+		size += 2 * (strlen(e->name) + plen) + strlen(hostname) + 20;
+	size += n * sizeof(struct idx_sel);
+
+	if(!(image = calloc(1, size))) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	h = (struct idx_header *)image;
+	sels = malloc(n * sizeof(struct idx_sel) + 1);
+	if(!sels) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	memcpy(h->magic, IDX_MAGIC, sizeof(h->magic));
+	h->version = IDX_VERSION;
+	h->port = port;
+	strncpy(h->host, hostname, MAX_HOSTNAME - 1);
+	h->mtime = sbuf.st_mtime;
+	h->size = sbuf.st_size;
+
+	// Always filled in, so the server need not preprocess
+	h->menu_off = sizeof(struct idx_header);
+	p = image + h->menu_off;
+	for(e = entries, i = 0; i < n; ++i, ++e) {
+		sels[i].off  = p - image + strlen(e->name) + 4;
+		sels[i].len  = strlen(e->name) + plen;
+		sels[i].type = e->type;
+		if(level == 0)
+			p += sprintf(p, "%c%s\t%c/%s\t%s\t%d\n",
+						 e->type, e->name, e->ftype, e->name, hostname, port);
+		else
+			p += sprintf(p, "%c%s\t%c/%s/%s\t%s\t%d\n",
+						 e->type, e->name, e->ftype, path, e->name,
+						 hostname, port);
+	}
+	h->menu_len = p - image - h->menu_off;
+
+	idx_base = image;
+	qsort(sels, n, sizeof(struct idx_sel), idx_compare);
+
+	h->sel_off = (p - image + sizeof(unsigned) - 1) & ~(sizeof(unsigned) - 1);
+	h->n_sels = n;
+	memcpy(image + h->sel_off, sels, n * sizeof(struct idx_sel));
+	size = h->sel_off + n * sizeof(struct idx_sel);
+
+	// The server may have the old one mapped, so replace it
+	sprintf(fname, "%s/.cache.idx", path);
+	sprintf(tmpname, "%s/.cache.idx.tmp%d", path, worker_n);
+	if((fp = fopen(tmpname, "w"))) {
+		ok = fwrite(image, size, 1, fp) == 1;
+		if(fclose(fp)) ok = 0;
+		if(!ok || replace_file(tmpname, fname)) {
+			perror(fname);
+			unlink(tmpname);
+			n = 0;
+		}
+	} else {
+		perror(tmpname);
+		n = 0;
+	}
+
+	free(sels);
+	free(image);
+
+	return n;
+}
+
+
+// size is how many entries there is room for
+void add_entry(struct entry **entries, int *size, int n, char *name, int isdir)
+{
+	struct entry *entry;
+	char *ext;
+
+	if(n == *size) {
+		*size = *size ? *size * 2 : 64;
+		*entries = realloc(*entries, *size * sizeof(struct entry));
+		if(*entries == NULL) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+
+	entry = (*entries) + n;
+
+	entry->name = must_strdup(name);
+	if(isdir) {
+		entry->type = entry->ftype = '1';
+		return;
+	}
+	else if((ext = strrchr(name, '.'))) {
+		int i;
+		char *mime;
+
+		++ext;
+		for(i = 0; i < N_EXTS; ++i)
+			if(strcasecmp(ext, exts[i].ext) == 0) {
+				entry->type = exts[i].type;
+				entry->ftype = exts[i].binary ? '9' : '0';
+				return;
+			}
+
+		// If there is an extension, default to binary
+		// Most formats are binary.
+		entry->type = entry->ftype = '9';
+
+		if((mime = mime_find(ext))) {
+			// try to intuit the type from the mime...
+			if(strncmp(mime, "text/html", 9) == 0) {
+				entry->type  = 'h';
+				entry->ftype = '0';
+			}
+			else if(strncmp(mime, "text/", 5) == 0)
+				entry->type = entry->ftype = '0';
+			else if(strncmp(mime, "image/", 6) == 0) {
+				entry->type = 'I';
+				entry->ftype = '9';
+			}
+		}
+	}
+	else
+		// Default to text as per gopher spec
+		entry->ftype = entry->type = '0';
+}
+
+
+/* readdir usually tells us. Links and file systems that do not say
+ * need a stat, which follows links.
+ */
+static int isdir(struct dirent *ent, DIR *dir, char *path)
+{
+	struct stat sbuf;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+	if(ent->d_type == DT_DIR) return 1;
+	if(ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) return 0;
+#endif
+
+	if(fstatat(dirfd(dir), ent->d_name, &sbuf, 0)) {
+		fprintf(stderr, "%s/%s: %s\n", path, ent->d_name, strerror(errno));
+		exit(1);
+	}
+
+	return S_ISDIR(sbuf.st_mode);
+}
+
+
+int read_dir(struct entry **entries, char *path, int level)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int nfiles = 0, size = 0;
+	int len = strlen(path);
+
+	if(!(dir = opendir(path))) {
+		perror("opendir");
+		return 0;
+	}
+
+	while((ent = readdir(dir))) {
+		if(*ent->d_name == '.') continue;
+
+		if(strcmp(ent->d_name, "gophermap") == 0) continue;
+
+		if(level == 0 && strcmp(ent->d_name, "favicon.ico") == 0)
+			continue;
+
+		// Do not add the top level icons directory
+		if(level == 0 && strcmp(ent->d_name, "icons") == 0)
+			continue;
+
+		if(isdir(ent, dir, path)) {
+			add_entry(entries, &size, nfiles, ent->d_name, 1);
+			++nfiles;
+
+			if(recurse) {
+				char *full;
+
+				// note: +2 for / and \0
+				if(!(full = malloc(len + strlen(ent->d_name) + 2))) {
+					printf("Out of memory\n");
+					exit(1);
+				}
+				if(level == 0)
+					strcpy(full, ent->d_name);
+				else
+					sprintf(full, "%s/%s", path, ent->d_name);
+#ifdef THREADS
+				if(jobs > 1)
+					pool_push(full, level + 1, nfiles - 1);
+				else
+#endif
+				{
+					process_dir(full, level + 1);
+					free(full);
+				}
+			}
+			else if(verbose > 1) printf("  %s/\n", ent->d_name);
+		} else {
+			if(verbose > 1) printf("  %s\n", ent->d_name);
+			add_entry(entries, &size, nfiles, ent->d_name, 0);
+			++nfiles;
+		}
+	}
+
+	closedir(dir);
+
+	return nfiles;
+}
+
+
+#ifdef THREADS
+/*
+ * mkcache -j. Each thread has a deque of directories still to do.
+ * A thread pushes the subdirectories it finds and pops from the same
+ * end, so it goes depth first like the single threaded walk. An idle
+ * thread steals from the other end of someone else's deque, taking
+ * the oldest and so usually the biggest piece of the tree. Each
+ * directory is written on its own, so the order does not matter,
+ * except for a directory we reach twice through a symlink.
+ *
+ * The single threaded walk writes a directory after everything under
+ * it, and the subdirectories in readdir order. So of two paths to one
+ * directory, it writes the one later in that order last, and that is
+ * the .cache it leaves. Each work item carries its readdir position
+ * at every level to compare by. A directory is claimed by (dev, ino)
+ * before it is walked and skipped if a later path has it, and the
+ * rename into place only happens if we still have the claim.
+ */
+
+struct work {
+	char *path;
+	int level;
+	int *key, n_key; // readdir position at each level below the root
+};
+
+struct claim {
+	dev_t dev;
+	ino_t ino;
+	int *key, n_key;
+	struct claim *next;
+};
+
+#define CLAIM_HASH	1024
+
+static struct claim *claims[CLAIM_HASH];
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The directory this thread is walking
+static THREAD_LOCAL struct work *cur;
+static THREAD_LOCAL struct claim *cur_claim;
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct work *q;
+	int head, tail, size; // steal from head, push and pop at tail
+};
+
+static struct worker *pool;
+static THREAD_LOCAL struct worker *self;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static int pending;   // directories pushed but not finished
+static unsigned gen;  // bumped on every push
+static int idle;
+
+
+// Is a written after b by the single threaded walk?
+static int later(int *a, int n_a, int *b, int n_b)
+{
+	int i;
+
+	for(i = 0; i < n_a && i < n_b; ++i)
+		if(a[i] != b[i])
+			return a[i] > b[i];
+
+	// a directory is written after its subdirectories
+	return n_a < n_b;
+}
+
+
+// Returns 0 if a path later in the walk has the directory
+static int claim_dir(struct work *work)
+{
+	struct stat sbuf;
+	struct claim *c;
+	unsigned h;
+	int *key = NULL, mine = 1;
+
+	cur_claim = NULL;
+	if(stat(work->path, &sbuf))
+		return 1; // read_dir will complain
+
+	if(work->n_key && !(key = malloc(work->n_key * sizeof(int)))) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	h = (unsigned)(sbuf.st_ino ^ sbuf.st_dev) % CLAIM_HASH;
+
+	pthread_mutex_lock(&claim_lock);
+	for(c = claims[h]; c; c = c->next)
+		if(c->ino == sbuf.st_ino && c->dev == sbuf.st_dev)
+			break;
+	if(!c) {
+		if(!(c = calloc(1, sizeof(struct claim)))) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+		c->dev = sbuf.st_dev;
+		c->ino = sbuf.st_ino;
+		c->next = claims[h];
+		claims[h] = c;
+	} else if(later(c->key, c->n_key, work->key, work->n_key))
+		mine = 0;
+	if(mine) {
+		free(c->key);
+		c->key = key;
+		c->n_key = work->n_key;
+		if(key) memcpy(key, work->key, work->n_key * sizeof(int));
+		key = NULL;
+		cur_claim = c;
+	}
+	pthread_mutex_unlock(&claim_lock);
+
+	free(key);
+	return mine;
+}
+
+
+static int replace_file(char *tmpname, char *fname)
+{
+	int rc = 0;
+
+	if(!cur_claim)
+		return rename(tmpname, fname);
+
+	// Under the lock, so a later path cannot claim it between
+	pthread_mutex_lock(&claim_lock);
+	if(later(cur_claim->key, cur_claim->n_key, cur->key, cur->n_key))
+		unlink(tmpname);
+	else
+		rc = rename(tmpname, fname);
+	pthread_mutex_unlock(&claim_lock);
+
+	return rc;
+}
+
+
+// pos is the directory's place in its parent, -1 for the root
+static void pool_push(char *path, int level, int pos)
+{
+	struct worker *w = self;
+	int *key = NULL, n_key = 0;
+
+	if(pos >= 0) {
+		n_key = cur->n_key + 1;
+		if(!(key = malloc(n_key * sizeof(int)))) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+		memcpy(key, cur->key, cur->n_key * sizeof(int));
+		key[cur->n_key] = pos;
+	}
+
+	// Count it before anyone can steal it, or a thief could finish it
+	// and take pending to 0 while there is still work
+	pthread_mutex_lock(&pool_lock);
+	++pending;
+	pthread_mutex_unlock(&pool_lock);
+
+	pthread_mutex_lock(&w->lock);
+	if(w->tail == w->size) {
+		// slide down what was stolen, else grow
+		if(w->head > w->size / 2) {
+			memmove(w->q, w->q + w->head,
+					(w->tail - w->head) * sizeof(struct work));
+			w->tail -= w->head;
+			w->head = 0;
+		} else {
+			w->size = w->size ? w->size * 2 : 64;
+			if(!(w->q = realloc(w->q, w->size * sizeof(struct work)))) {
+				printf("Out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	w->q[w->tail].path = path;
+	w->q[w->tail].level = level;
+	w->q[w->tail].key = key;
+	w->q[w->tail].n_key = n_key;
+	++w->tail;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&pool_lock);
+	++gen;
+	if(idle)
+		pthread_cond_signal(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+static int pool_take(struct worker *w, struct work *work, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->head < w->tail) {
+		*work = steal ? w->q[w->head++] : w->q[--w->tail];
+		if(w->head == w->tail)
+			w->head = w->tail = 0;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+
+// Returns 0 when the whole tree is done
+static int pool_get(struct work *work)
+{
+	unsigned seen;
+	int i, n = self - pool;
+
+	while(1) {
+		pthread_mutex_lock(&pool_lock);
+		seen = gen;
+		pthread_mutex_unlock(&pool_lock);
+
+		if(pool_take(self, work, 0))
+			return 1;
+		for(i = 1; i < jobs; ++i)
+			if(pool_take(&pool[(n + i) % jobs], work, 1))
+				return 1;
+
+		pthread_mutex_lock(&pool_lock);
+		if(pending == 0) {
+			pthread_mutex_unlock(&pool_lock);
+			return 0;
+		}
+		if(gen == seen) {
+			++idle;
+			pthread_cond_wait(&pool_wake, &pool_lock);
+			--idle;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+
+static void *pool_worker(void *arg)
+{
+	struct work work;
+
+	self = arg;
+	worker_n = self - pool;
+
+	while(pool_get(&work)) {
+		cur = &work;
+		if(claim_dir(&work))
+			process_dir(work.path, work.level);
+		cur = NULL;
+		cur_claim = NULL;
+		free(work.path);
+		free(work.key);
+
+		pthread_mutex_lock(&pool_lock);
+		if(--pending == 0)
+			pthread_cond_broadcast(&pool_wake);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	return NULL;
+}
+
+
+static void pool_walk(char *path, int level)
+{
+	int i;
+
+	if(!(pool = calloc(jobs, sizeof(struct worker)))) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	for(i = 0; i < jobs; ++i)
+		pthread_mutex_init(&pool[i].lock, NULL);
+
+	// We are worker 0
+	self = pool;
+	pool_push(must_strdup(path), level, -1);
+
+	for(i = 1; i < jobs; ++i)
+		if(pthread_create(&pool[i].thread, NULL, pool_worker, &pool[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+
+	pool_worker(pool);
+
+	for(i = 1; i < jobs; ++i)
+		pthread_join(pool[i].thread, NULL);
+
+	for(i = 0; i < jobs; ++i) {
+		pthread_mutex_destroy(&pool[i].lock);
+		free(pool[i].q);
+	}
+	free(pool);
+	pool = NULL;
+	self = NULL;
+
+	for(i = 0; i < CLAIM_HASH; ++i)
+		while(claims[i]) {
+			struct claim *c = claims[i];
+
+			claims[i] = c->next;
+			free(c->key);
+			free(c);
+		}
+}
+#else
+static int replace_file(char *tmpname, char *fname)
+{
+	return rename(tmpname, fname);
+}
+#endif
+
+
+// process_dir, with -j threads if recursing
+void process_tree(char *path, int level)
+{
+#ifdef THREADS
+	if(recurse && jobs > 1) {
+		pool_walk(path, level);
+		return;
+	}
+#endif
+	jobs = 1;
+	process_dir(path, level);
+}
@@ -40,24 +40,162 @@
 
 int verbose = 0;
 
-// Stats
-unsigned max_requests = 0;
-unsigned max_length = 0;
-unsigned n_requests = 0;
-int      n_connections = 0; // yes signed, I want to know if it goes -ve
+// Stats - one per event loop
+static struct stats my_stats;
+THREAD_LOCAL struct stats *stats = &my_stats;
+static struct stats *all_stats = &my_stats;
 time_t   started;
 
+// Only the parent has the worker pids
+static pid_t *worker_pids;
+
 // Add an extra connection for error replies
-static struct connection *conns;
+static struct connection *all_conns;
+
+// Each event loop gets a slice of all_conns
+static THREAD_LOCAL struct connection *conns;
+static THREAD_LOCAL int n_conns;
+static THREAD_LOCAL int loop_n;
+
+#ifdef HAVE_IO_URING
+/* The accept is 0, connections are their slot + 1 in the top half.
+ * The generation in the bottom half lets us drop completions for a
+ * slot that has since been closed and reused. A connection has at
+ * most one request in the ring and ring_armed says which.
+ */
+#define URING_ACCEPT	0ULL
+#define URING_DATA(c) \
+	(((unsigned long long)((c)->conn_n + 1) << 32) | (c)->ring_gen)
+
+#define RING_POLL	1
+#define RING_RECV	2
+
+static THREAD_LOCAL int uring_active;
+static THREAD_LOCAL int accept_armed, accept_multi = 1;
+
+/* Sockets the ring accepted after we ran out of slots. A multishot
+ * accept drains the whole backlog when it wakes, so this can be well
+ * past n_conns before the cancel lands.
+ */
+static THREAD_LOCAL int *parked, n_parked, max_parked;
+
+static void start_uring(int csock);
+
+// Takes back whatever the connection has in the ring
+static void uring_disarm(struct connection *conn)
+{
+	if(conn->ring_armed == RING_POLL)
+		uring_poll_remove(URING_DATA(conn));
+	else if(conn->ring_armed == RING_RECV)
+		uring_submit(); // done with cmd and the socket when this returns
+	conn->ring_armed = 0;
+	++conn->ring_gen;
+}
+
+// Polls are oneshot, so a connection is armed at most once
+static void uring_arm(struct connection *conn)
+{
+	if(conn->ring_armed) uring_disarm(conn);
+	if(uring_poll_add(SOCKET(conn), conn->ring_events,
+					  URING_DATA(conn), 0) == 0)
+		conn->ring_armed = RING_POLL;
+}
+#endif
+
+#ifdef HAVE_EPOLL
+static THREAD_LOCAL int epfd = -1;
+static int accept_sock;
+static THREAD_LOCAL int accept_throttled;
+
+static void start_epolling(int csock);
+
+/*
+ * The sockets are registered edge triggered. This means read_request
+ * and new_connection must keep going until they get an EAGAIN.
+ */
+void set_readable(struct connection *conn, int sock)
+{
+	struct epoll_event ev;
+	int op = conn->sock == sock ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	conn->sock = sock;
+#ifdef HAVE_IO_URING
+	if(uring_active) {
+		conn->ring_events = POLLIN;
+		uring_arm(conn);
+		return;
+	}
+#endif
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = conn;
+	if(epoll_ctl(epfd, op, sock, &ev))
+		syslog(LOG_WARNING, "epoll_ctl: %m");
+}
+
+void set_writeable(struct connection *conn)
+{
+	struct epoll_event ev;
+
+#ifdef HAVE_IO_URING
+	if(uring_active) {
+		conn->ring_events = POLLOUT;
+		uring_arm(conn);
+		return;
+	}
+#endif
+	ev.events = EPOLLOUT | EPOLLET;
+	ev.data.ptr = conn;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev))
+		syslog(LOG_WARNING, "epoll_ctl: %m");
+}
+
+static void set_accepting(int on)
+{
+	struct epoll_event ev;
 
-#ifdef HAVE_POLL
-static struct pollfd *ufds;
-static int npoll;
+#ifdef HAVE_IO_URING
+	if(uring_active) { // start_uring looks after the accept
+		accept_throttled = !on;
+		return;
+	}
+#endif
+	// A MOD reports the socket again if it is still readable
+	ev.events = on ? (EPOLLIN | EPOLLET) : 0;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, accept_sock, &ev))
+		syslog(LOG_WARNING, "epoll_ctl: %m");
+	accept_throttled = !on;
+}
+#elif defined(HAVE_POLL)
+static THREAD_LOCAL struct pollfd *ufds;
+static THREAD_LOCAL int npoll;
 
 static void start_polling(int csock);
+
+#ifdef HAVE_IO_URING
+void set_readable(struct connection *conn, int sock)
+{
+	conn->ufd->fd = sock;
+	conn->ufd->events = POLLIN;
+	if(conn->conn_n + 2 > npoll) npoll = conn->conn_n + 2;
+	if(uring_active) {
+		conn->ring_events = POLLIN;
+		uring_arm(conn);
+	}
+}
+
+void set_writeable(struct connection *conn)
+{
+	conn->ufd->events = POLLOUT;
+	if(uring_active) {
+		conn->ring_events = POLLOUT;
+		uring_arm(conn);
+	}
+}
+#endif
 #else
-static fd_set readfds, writefds;
-static int nfds;
+static THREAD_LOCAL fd_set readfds, writefds;
+static THREAD_LOCAL int nfds;
 static int accept_sock;
 
 static void start_selecting(int csock);
@@ -76,11 +214,15 @@ static uid_t root_uid;
 static void gofish(char *name);
 static void create_pidfile(char *fname);
 static int new_connection(int csock);
+static int open_connection(struct connection *conn, unsigned addr, int i);
 static int read_request(struct connection *conn);
+static int request_data(struct connection *conn, int n);
+static int parse_request(struct connection *conn);
 static int write_request(struct connection *conn);
 static int gofish_stats(struct connection *conn);
-static void check_old_connections(void);
-static int open_cache(char *fname);
+static void expire_connection(struct connection *conn);
+static int start_workers(int csock);
+static void start_loops(int csock);
 
 
 // SIGUSR1 is handled in log.c
@@ -91,6 +233,12 @@ static void sighandler(int signum)
 	case SIGTERM:
 	case SIGINT:
 		// Somebody wants us to quit
+		if(worker_pids) {
+			int i;
+
+			for(i = 0; i < workers; ++i)
+				if(worker_pids[i] > 0) kill(worker_pids[i], signum);
+		}
 		syslog(LOG_INFO, "GoFish stopping.");
 		log_close();
 		exit(0);
@@ -99,7 +247,16 @@ static void sighandler(int signum)
 		// connection on us.
 		break;
 	case SIGCHLD:
-		// CGI finished
+		// CGI or worker finished
+		break;
+	case SIGUSR1:
+		// Only the parent gets here. Pass on the log rotation.
+		if(worker_pids) {
+			int i;
+
+			for(i = 0; i < workers; ++i)
+				if(worker_pids[i] > 0) kill(worker_pids[i], signum);
+		}
 		break;
 	default:
 		syslog(LOG_WARNING, "Got an unexpected %d signal\n", signum);
@@ -115,7 +272,7 @@ static void cleanup()
 
 	http_cleanup();
 
-#ifdef HAVE_POLL
+#if defined(HAVE_POLL) && !defined(HAVE_EPOLL)
 	close(ufds[0].fd); // accept socket
 #else
 	close(accept_sock); // accept socket
@@ -126,7 +283,7 @@ static void cleanup()
      * Close any outstanding connections.
      * Free any cached memory.
      */
-	for(conn = conns, i = 0; i < max_conns; ++i, ++conn) {
+	for(conn = conns, i = 0; i < n_conns; ++i, ++conn) {
 		if(SOCKET(conn) != -1) close_connection(conn, 500);
 		if(conn->cmd) free(conn->cmd);
 	}
@@ -135,11 +292,18 @@ static void cleanup()
 	free(hostname);
 	free(logfile);
 	free(pidfile);
+	free(metrics_path);
 
-	free(conns);
-#ifdef HAVE_POLL
+	free(all_conns);
+#ifdef HAVE_EPOLL
+	close(epfd);
+#elif defined(HAVE_POLL)
 	free(ufds);
 #endif
+#ifdef HAVE_IO_URING
+	free(parked);
+	uring_exit();
+#endif
 
 	mime_cleanup();
 
@@ -174,7 +338,23 @@ int main(int argc, char *argv[])
 
 	if(max_conns == 0) max_conns = 25;
 
-	if(!(conns = calloc(max_conns, sizeof(struct connection)))) {
+#ifdef THREADS
+	if(threads < 1) threads = 1;
+	if(threads > max_conns) threads = max_conns;
+	if(threads > 1 && virtual_hosts) {
+		// virtual hosts chdir per request
+		printf("virtual_hosts not supported with threads\n");
+		threads = 1;
+	}
+#ifdef CGI
+	if(threads > 1) {
+		printf("CGI not supported with threads\n");
+		threads = 1;
+	}
+#endif
+#endif
+
+	if(!(all_conns = calloc(max_conns, sizeof(struct connection)))) {
 		syslog(LOG_CRIT, "Not enough memory. Try reducing max-connections.");
 		exit(1);
 	}
@@ -239,6 +419,7 @@ void gofish(char *name)
 
 	// Do this *before* chroot
 	log_open(logfile);
+	mmap_pressure_init();
 
 #ifndef NO_CHROOT
 	if(chroot(root_dir)) {
@@ -266,18 +447,51 @@ void gofish(char *name)
 		exit(1);
 	}
 
+	if(workers * threads > 1 &&
+	   !(all_stats = mmap_shared(workers * threads * sizeof(struct stats)))) {
+		syslog(LOG_CRIT, "Not enough memory for the stats.");
+		exit(1);
+	}
+	stats = all_stats;
+	stats->pid = getpid();
+
+	// Only the workers return
+	if(workers > 1) csock = start_workers(csock);
+
 	seteuid(uid);
 
-	memset(conns, 0, sizeof(conns));
-	for(i = 0; i < max_conns; ++i) {
-		conns[i].status = 200;
-		conns[i].conn_n = i;
-	}
+	for(i = 0; i < max_conns; ++i)
+		all_conns[i].status = 200;
 
 	mmap_init();
+	sel_init();
+	menu_init();
+
+	start_loops(csock); // never returns
+}
+
+
+static void event_loop(int n, int csock)
+{
+	int i, per = max_conns / threads, extra = max_conns % threads;
+
+	// Spread any leftover connections over the first loops
+	loop_n  = n;
+	conns   = all_conns + n * per + (n < extra ? n : extra);
+	n_conns = per + (n < extra ? 1 : 0);
+
+	for(i = 0; i < n_conns; ++i) {
+		conns[i].conn_n = i;
+		conns[i].sendfd = -1;
+	}
 
-	// These never return
-#ifdef HAVE_POLL
+	// These never return, except start_uring if it has no ring
+#ifdef HAVE_IO_URING
+	start_uring(csock);
+#endif
+#ifdef HAVE_EPOLL
+	start_epolling(csock);
+#elif defined(HAVE_POLL)
 	start_polling(csock);
 #else
 	start_selecting(csock);
@@ -285,33 +499,313 @@ void gofish(char *name)
 }
 
 
-#ifdef HAVE_POLL
+#ifdef THREADS
+struct loop_args {
+	int n;
+	int csock;
+	struct stats *stats;
+};
+
+static void *loop_thread(void *arg)
+{
+	struct loop_args *args = arg;
+
+	stats = args->stats;
+	event_loop(args->n, args->csock);
+	return NULL;
+}
+#endif
+
+
+/*
+ * Each thread runs its own event loop with its own slice of the
+ * connections. They all share the accept socket. The main thread
+ * runs loop 0 and handles the signals.
+ */
+static void start_loops(int csock)
+{
+#ifdef THREADS
+	struct loop_args *args;
+	pthread_t thread;
+	sigset_t set, old;
+	int n;
+#endif
+
+	log_start();
+
+#ifdef THREADS
+	if(threads > 1) {
+		if(!(args = calloc(threads, sizeof(struct loop_args)))) {
+			syslog(LOG_CRIT, "Not enough memory for %d threads.", threads);
+			exit(1);
+		}
+
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &old);
+
+		for(n = 1; n < threads; ++n) {
+			args[n].n = n;
+			args[n].csock = csock;
+			args[n].stats = stats + n;
+			args[n].stats->pid = stats->pid;
+			if(pthread_create(&thread, NULL, loop_thread, &args[n])) {
+				syslog(LOG_CRIT, "Unable to create thread %d", n);
+				exit(1);
+			}
+			pthread_detach(thread);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+#endif
+
+	event_loop(0, csock);
+}
+
+
+static int fork_worker(int n, int csock)
+{
+	pid_t pid;
+	int i;
+
+	if((pid = fork()) == 0) {
+		// child
+		free(worker_pids);
+		worker_pids = NULL;
+
+		stats = &all_stats[n * threads];
+		for(i = 0; i < threads; ++i) {
+			stats[i].pid = getpid();
+			stats[i].n_connections = 0;
+		}
+
+		signal(SIGUSR1, log_reopen);
+
+		if(is_reuseport() && (n > 0 || csock == -1)) {
+			// reuseport: we want our own socket, the parent's is for
+			// worker 0 if the parent still has it
+			if(csock != -1) close(csock);
+			if((csock = listen_socket(port)) < 0) {
+				syslog(LOG_ERR, "Worker %d: unable to create socket: %m", n);
+				exit(1);
+			}
+		}
+
+		return csock;
+	}
+
+	if(pid == -1)
+		syslog(LOG_ERR, "Worker %d: fork: %m", n);
+
+	worker_pids[n] = pid;
+	return -1;
+}
+
+
+/* Forks worker n, see fork_worker. We only close the parent's socket
+ * once worker 0 really has it. If that fork failed, worker 0 gets it
+ * when the fork is tried again.
+ */
+static int spawn_worker(int n, int *csock, time_t *started_at)
+{
+	int sock;
+
+	time(&started_at[n]);
+	if((sock = fork_worker(n, *csock)) >= 0)
+		return sock;
+
+	if(n == 0 && is_reuseport() && worker_pids[0] > 0 && *csock != -1) {
+		close(*csock);
+		*csock = -1;
+	}
+	return -1;
+}
+
+
+/*
+ * The parent forks the workers and then just sits around restarting
+ * any that die. All the workers accept on the parent's socket unless
+ * reuseport is set. Then each worker binds its own socket and the
+ * kernel spreads the connections. The parent's socket goes to worker
+ * 0, since closing it would reset any connections queued on it. A
+ * worker we could not fork is tried again every second.
+ */
+static int start_workers(int csock)
+{
+	time_t *started_at;
+	int i, n, status, sock;
+	pid_t pid;
+
+	if(!(worker_pids = calloc(workers, sizeof(pid_t))) ||
+	   !(started_at = calloc(workers, sizeof(time_t)))) {
+		syslog(LOG_CRIT, "Not enough memory for %d workers.", workers);
+		exit(1);
+	}
+
+	signal(SIGUSR1, sighandler);
+
+	for(i = 0; i < workers; ++i)
+		if((sock = spawn_worker(i, &csock, started_at)) >= 0) {
+			free(started_at);
+			return sock;
+		}
+
+	syslog(LOG_INFO, "Started %d workers.", workers);
+
+	while(1) {
+		// A worker we could not fork is tried again every second
+		for(n = 0; n < workers; ++n)
+			if(worker_pids[n] == -1 && time(NULL) - started_at[n] >= 1 &&
+			   (sock = spawn_worker(n, &csock, started_at)) >= 0) {
+				free(started_at);
+				return sock;
+			}
+		for(n = 0; n < workers && worker_pids[n] != -1; ++n) ;
+
+		if(n < workers) {
+			// Do not block, we have a fork to retry
+			sleep(1);
+			if((pid = waitpid(-1, &status, WNOHANG)) <= 0)
+				continue;
+		} else if((pid = wait(&status)) < 0) {
+			if(errno != EINTR) {
+				syslog(LOG_WARNING, "wait: %m");
+				sleep(1);
+			}
+			continue;
+		}
+
+		for(n = 0; n < workers && worker_pids[n] != pid; ++n) ;
+		if(n == workers) continue; // not ours
+
+		if(WIFSIGNALED(status))
+			syslog(LOG_ERR, "Worker %d (pid %d) killed by signal %d.",
+				   n, pid, WTERMSIG(status));
+		else
+			syslog(LOG_ERR, "Worker %d (pid %d) exited with %d.",
+				   n, pid, WEXITSTATUS(status));
+
+		// Do not spin if the worker dies right away
+		if(time(NULL) - started_at[n] < 1) sleep(1);
+
+		if((sock = spawn_worker(n, &csock, started_at)) >= 0) {
+			free(started_at);
+			return sock;
+		}
+	}
+}
+
+
+#ifdef HAVE_EPOLL
+void start_epolling(int csock)
+{
+	struct connection *conn;
+	struct epoll_event *events, ev;
+	int i, n, accepting;
+
+	if((epfd = epoll_create(n_conns + 1)) < 0) {
+		syslog(LOG_CRIT, "epoll_create: %m");
+		exit(1);
+	}
+
+	if(!(events = calloc(n_conns + 1, sizeof(struct epoll_event)))) {
+		syslog(LOG_CRIT, "Not enough memory. Try reducing max-connections.");
+		exit(1);
+	}
+
+	for(i = 0; i < n_conns; ++i) conns[i].sock = -1;
+
+	accept_sock = csock;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL; // the accept socket
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, csock, &ev)) {
+		syslog(LOG_CRIT, "epoll_ctl: %m");
+		exit(1);
+	}
+
+	// Now it is safe to install
+	if(loop_n == 0) atexit(cleanup);
+
+	timer_init();
+
+	while(1) {
+		n = epoll_wait(epfd, events, n_conns + 1, timer_next());
+
+		timer_run(expire_connection);
+
+		if(n < 0) {
+			if(errno == EINTR) {
+#ifdef CGI
+				reap_children();
+#endif
+			} else
+				syslog(LOG_WARNING, "epoll_wait: %m");
+			continue;
+		}
+
+		// Only the ready sockets are returned
+		accepting = 0;
+		for(i = 0; i < n; ++i) {
+			if((conn = events[i].data.ptr) == NULL) {
+				accepting = 1;
+				continue;
+			}
+
+			if(conn->sock == -1) continue; // closed under us
+
+			if(events[i].events & EPOLLIN)
+				read_request(conn);
+			else if(events[i].events & EPOLLOUT)
+				write_request(conn);
+			else if(events[i].events & (EPOLLHUP | EPOLLERR)) {
+				if(events[i].events & EPOLLHUP) {
+					syslog(LOG_DEBUG, "Connection hung up");
+					close_connection(conn, 504);
+				} else {
+					syslog(LOG_DEBUG, "Events = 0x%x", events[i].events);
+					close_connection(conn, 501);
+				}
+			}
+		}
+
+		// Accept last so a reused slot never sees a stale event
+		if(accepting) new_connection(csock);
+	}
+}
+
+#elif defined(HAVE_POLL)
 void start_polling(int csock)
 {
 	struct connection *conn;
 	int i, n;
-	int timeout;
 
-	if(!(ufds = calloc(max_conns + 1, sizeof(struct pollfd)))) {
+	if(!(ufds = calloc(n_conns + 1, sizeof(struct pollfd)))) {
 		syslog(LOG_CRIT, "Not enough memory. Try reducing max-connections.");
 		exit(1);
 	}
 
-	for(i = 0; i < max_conns; ++i) {
+	for(i = 0; i < n_conns; ++i) {
 		conns[i].ufd = &ufds[i + 1];
 		conns[i].ufd->fd = -1;
 	}
 
 	// Now it is safe to install
-	atexit(cleanup);
+	if(loop_n == 0) atexit(cleanup);
 
 	ufds[0].fd = csock;
 	ufds[0].events = POLLIN;
 	npoll = 1;
 
+	timer_init();
+
 	while(1) {
-		timeout = n_connections ? (POLL_TIMEOUT * 1000) : -1;
-		if((n = poll(ufds, npoll, timeout)) < 0) {
+		n = poll(ufds, npoll, timer_next());
+
+		// Expired connections are closed, clearing their revents
+		timer_run(expire_connection);
+
+		if(n < 0) {
 			if(errno == EINTR) {
 #ifdef CGI
 				reap_children();
@@ -321,16 +815,6 @@ void start_polling(int csock)
 			continue;
 		}
 
-		/* Simplistic timeout to start with.
-		 * Only check for old connections on a timeout.
-		 * Low overhead, but under high load may leave connections
-		 * around longer.
-		 */
-		if(n == 0) {
-			check_old_connections();
-			continue;
-		}
-
 		if(ufds[0].revents) {
 			new_connection(ufds[0].fd);
 			--n;
@@ -373,7 +857,7 @@ static inline struct connection *find_conn(fd)
 {
 	int i;
 
-	for(i = 0; i < max_conns; ++i)
+	for(i = 0; i < n_conns; ++i)
 		if(conns[i].sock == fd)
 			return &conns[i];
 
@@ -387,8 +871,9 @@ void start_selecting(int csock)
 	struct connection *conn;
 	fd_set cur_reads, cur_writes;
 	struct timeval *timeout, timeoutval;
+	int ms, accepting;
 
-	for(n = 0; n < max_conns; ++n) conns[n].sock = -1;
+	for(n = 0; n < n_conns; ++n) conns[n].sock = -1;
 
 	FD_ZERO(&readfds);
 	FD_ZERO(&writefds);
@@ -398,40 +883,34 @@ void start_selecting(int csock)
 
 	accept_sock = csock;
 
-	atexit(cleanup);
+	if(loop_n == 0) atexit(cleanup);
 
+	timer_init();
 
 	while(1) {
 		memcpy(&cur_reads,  &readfds, sizeof(fd_set));
 		memcpy(&cur_writes, &writefds, sizeof(fd_set));
 
-		if(n_connections) {
+		if((ms = timer_next()) >= 0) {
 			// We must reset the timeout every time!
-			timeoutval.tv_sec  = POLL_TIMEOUT;
-			timeoutval.tv_usec = 0;
+			timeoutval.tv_sec  = ms / 1000;
+			timeoutval.tv_usec = (ms % 1000) * 1000;
 			timeout = &timeoutval;
 		} else
 			timeout = NULL;
-		if((n = select(nfds, &cur_reads, &cur_writes, NULL, timeout)) < 0) {
+		n = select(nfds, &cur_reads, &cur_writes, NULL, timeout);
+
+		timer_run(expire_connection);
+
+		if(n < 0) {
 			if(errno != EINTR)
 				syslog(LOG_WARNING, "select: %m");
 			continue;
 		}
 
-		/* Simplistic timeout to start with.
-		 * Only check for old connections on a timeout.
-		 * Low overhead, but under high load may leave connections
-		 * around longer.
-		 */
-		if(n == 0) {
-			check_old_connections();
-			continue;
-		}
-
-		if(FD_ISSET(csock, &cur_reads)) {
+		if((accepting = FD_ISSET(csock, &cur_reads))) {
 			--n;
 			FD_CLR(csock, &cur_reads);
-			new_connection(csock);
 		}
 
 		for(fd = 0; n > 0 && fd < nfds; ++fd) {
@@ -450,156 +929,264 @@ void start_selecting(int csock)
 			}
 		}
 
+		// Accept last so a reused fd never sees a stale event
+		if(accepting) new_connection(csock);
+
 		if(n > 0) syslog(LOG_DEBUG, "Not all requests processed");
 	}
 }
 #endif
 
-#ifdef ALLOW_NON_ROOT
-int checkpath(char *path)
-{
-#if 0
-	// This does not work in a chroot environment
-	char full[PATH_MAX + 2];
-	char real[PATH_MAX + 2];
-	int  len = strlen(root_dir);
 
-	strcpy(full, root_dir);
-	strcat(full, "/");
-	strncat(full, path, PATH_MAX - len);
-	full[PATH_MAX] = '\0';
+#ifdef HAVE_IO_URING
+// The throttle flag belongs to whichever data model we are built with
+#ifdef HAVE_EPOLL
+#define ACCEPTING()		(!accept_throttled)
+#define THROTTLE()		set_accepting(0)
+#else
+#define ACCEPTING()		(ufds[0].events != 0)
+#define THROTTLE()		(ufds[0].events = 0)
+#endif
 
-	if(!realpath(full, real)) {
-		return 1;
-	}
+/* A socket from the ring's accept. Its first recv goes in with the
+ * next submit, so a request that came with the connection costs no
+ * extra wakeup. Returns -1, throttled, if there is no free slot.
+ */
+static int uring_accepted(int sock)
+{
+	struct connection *conn;
+	unsigned addr;
+	int i;
 
-	if(strncmp(real, root_dir, len)) {
-		errno = EACCES;
-		return -1;
-	}
-#else
-	// A .. at the end is safe since it will never specify a file,
-	// only a directory.
-	if(strncmp(path, "../", 3) == 0 || (int)strstr(path, "/../")) {
-		errno = EACCES;
+	for(conn = conns, i = 0; i < n_conns; ++i, ++conn)
+		if(SOCKET(conn) == -1) break;
+	if(i == n_conns) {
+		if(ACCEPTING()) {
+			syslog(LOG_WARNING, "Too many connections.");
+			++stats->throttled;
+			THROTTLE();
+			if(accept_armed) uring_cancel(URING_ACCEPT);
+		}
 		return -1;
 	}
-#endif
+
+	if(peer_addr(sock, &addr)) {
+		syslog(LOG_WARNING, "Accept connection: %m");
+		close(sock);
+		return 0;
+	}
+
+	SOCKET(conn) = sock;
+#if defined(HAVE_POLL) && !defined(HAVE_EPOLL)
+	if(conn->conn_n + 2 > npoll) npoll = conn->conn_n + 2;
+#endif
+	if(open_connection(conn, addr, i)) return 0;
+
+	conn->ring_events = POLLIN;
+	if(uring_recv(sock, conn->cmd, MAX_LINE, URING_DATA(conn)) == 0)
+		conn->ring_armed = RING_RECV;
+	else
+		uring_arm(conn);
 
 	return 0;
 }
-#endif
 
 
-// This handles parsing the name and opening the file
-// We allow the following /?<selector>/<path> || nothing
-// Returns the selector type in `selector'
-int smart_open(char *name, char *type)
+static void park(int sock)
 {
-	FILE *fp;
-	int fd;
-	struct stat sbuf;
-	char dirname[MAX_LINE + 10], *p, *e;
-
-	if(*name == '/') ++name;
-
-	// This is worth optimizing
-	if(*name == '\0') {
-		*type = '1';
-		return open_cache(".cache");
-	}
-
-	// Fast path - type specified
-	if(*(name + 1) == '/') {
-		*type = *name;
-		name += 2;
-
-		switch(*type) {
-		case '0':
-		case '4':
-		case '5':
-		case '6':
-		case '9':
-		case 'g':
-		case 'h':
-		case 'I':
-			return open(name, O_RDONLY);
-		case '1':
-			strcpy(dirname, name);
-			p = dirname + strlen(dirname);
-			if(*(p - 1) != '/') *p++ = '/';
-			strcpy(p, ".cache");
-			return open_cache(dirname);
-		default:
-			errno = EINVAL;
-			return -1;
+	int *new;
+
+	if(n_parked == max_parked) {
+		if(!(new = realloc(parked, (max_parked + n_conns) * sizeof(int)))) {
+			syslog(LOG_WARNING, "Out of memory.");
+			close(sock);
+			return;
 		}
+		parked = new;
+		max_parked += n_conns;
 	}
 
-#ifndef STRICT_GOPHER
-	// Regular path
-	if((fd = open(name, O_RDONLY)) < 0) return -1;
+	parked[n_parked++] = sock;
+}
 
-	if(fstat(fd, &sbuf)) {
-		close(fd);
-		return -1;
+
+/* Same state machine as the other loops, but the accept, the first
+ * read and the polls are all io_uring requests. All the (re)arming
+ * for one pass goes to the kernel with the wait, so we make one
+ * syscall per pass instead of one per ready socket. Returns only if
+ * we cannot get a ring, in which case the caller falls back to
+ * epoll or poll.
+ */
+static void start_uring(int csock)
+{
+	struct connection *conn;
+	unsigned long long data;
+	int i, n, res, more, status, kind;
+
+	if(uring_init(n_conns * 2 + 2)) {
+		syslog(LOG_WARNING, "io_uring: %m, not using it");
+		return;
 	}
 
-	strcpy(dirname, name);
+#ifdef HAVE_EPOLL
+	for(i = 0; i < n_conns; ++i) conns[i].sock = -1;
 
-	if(S_ISDIR(sbuf.st_mode)) {
-		*type = '1';
-		close(fd);
+	accept_sock = csock;
+#else
+	if(!(ufds = calloc(n_conns + 1, sizeof(struct pollfd)))) {
+		syslog(LOG_CRIT, "Not enough memory. Try reducing max-connections.");
+		exit(1);
+	}
 
-		p = dirname + strlen(dirname);
-		if(*(p - 1) != '/') *p++ = '/';
-		strcpy(p, ".cache");
-		return open_cache(dirname);
+	for(i = 0; i < n_conns; ++i) {
+		conns[i].ufd = &ufds[i + 1];
+		conns[i].ufd->fd = -1;
 	}
 
-	if((p = strrchr(dirname, '/')))
-		strcpy(p + 1, ".cache");
-	else
-		strcpy(dirname, ".cache");
+	// ufds[0].events is still our throttle flag
+	ufds[0].fd = csock;
+	ufds[0].events = POLLIN;
+	npoll = 1;
+#endif
 
+	// Now it is safe to install
+	if(loop_n == 0) atexit(cleanup);
 
-	if((fp = fopen(dirname, "r")) == NULL) {
-		close(fd);
-		return -1;
-	}
+	uring_active = 1;
+
+	timer_init();
+
+	while(1) {
+		/* Accept after the closes so we use any freed slots, and
+		 * the parked sockets first since they have waited longest.
+		 * While we are throttled the accept is cancelled and the
+		 * backlog holds the connections until a close turns
+		 * accepting back on.
+		 */
+		while(n_parked && ACCEPTING() && uring_accepted(*parked) == 0)
+			memmove(parked, parked + 1, --n_parked * sizeof(int));
+		if(ACCEPTING() && !accept_armed &&
+		   uring_accept(csock, URING_ACCEPT, accept_multi) == 0)
+			accept_armed = 1;
+
+		n = uring_wait(timer_next());
 
-	while(fgets(dirname, sizeof(dirname), fp)) {
-		if((p = strchr(dirname, '\t'))) {
-			p += 3;
-			if((e = strchr(p, '\t'))) {
-				*e = '\0';
-				if(strcmp(name, p) == 0) {
-					fclose(fp);
-					*type = *dirname;
-					return fd;
+		timer_run(expire_connection);
+
+		if(n < 0) {
+			if(errno == EINTR) {
+#ifdef CGI
+				reap_children();
+#endif
+			} else
+				syslog(LOG_WARNING, "io_uring_enter: %m");
+			continue;
+		}
+
+		while(uring_next(&data, &res, &more)) {
+			if(data == URING_ACCEPT) {
+				if(!more) accept_armed = 0;
+				if(res >= 0) {
+					if(uring_accepted(res) == 0)
+						continue;
+					park(res);
+				} else if(res == -EINVAL && accept_multi)
+					accept_multi = 0; // multishot needs 5.19
+				else if(res != -ECANCELED) {
+					errno = -res;
+					syslog(LOG_WARNING, "Accept connection: %m");
+				}
+				continue;
+			}
+
+			i = (data >> 32) - 1;
+			if(i < 0 || i >= n_conns) continue; // URING_IGNORE
+			conn = &conns[i];
+			if((unsigned)data != conn->ring_gen || !conn->ring_armed)
+				continue; // stale
+			kind = conn->ring_armed;
+			conn->ring_armed = 0;
+
+			if(kind == RING_RECV) {
+				// -EAGAIN: nothing yet, so poll for it below
+				if(res >= 0)
+					request_data(conn, res);
+				else if(res != -EAGAIN) {
+					errno = -res;
+					syslog(LOG_WARNING, "Read error (%d): %m", errno);
+					close_connection(conn, 408);
+				}
+			} else if(res > 0 && (res & POLLIN))
+				read_request(conn);
+			else if(res > 0 && (res & POLLOUT))
+				write_request(conn);
+			else {
+				// Error
+				if(res < 0) {
+					errno = -res;
+					syslog(LOG_DEBUG, "io_uring poll: %m");
+					status = 501;
+				} else if(res & POLLHUP) {
+					syslog(LOG_DEBUG, "Connection hung up");
+					status = 504;
+				} else if(res & POLLNVAL) {
+					syslog(LOG_DEBUG, "Connection invalid");
+					status = 410;
+				} else {
+					syslog(LOG_DEBUG, "Revents = 0x%x", res);
+					status = 501;
 				}
+
+				close_connection(conn, status);
 			}
+
+			// Still waiting on the same event (e.g. partial read)
+			if(SOCKET(conn) != -1 && !conn->ring_armed)
+				uring_arm(conn);
 		}
 	}
+}
+#endif
 
-	fclose(fp);
+#ifdef ALLOW_NON_ROOT
+int checkpath(char *path)
+{
+#if 0
+	// This does not work in a chroot environment
+	char full[PATH_MAX + 2];
+	char real[PATH_MAX + 2];
+	int  len = strlen(root_dir);
+
+	strcpy(full, root_dir);
+	strcat(full, "/");
+	strncat(full, path, PATH_MAX - len);
+	full[PATH_MAX] = '\0';
+
+	if(!realpath(full, real)) {
+		return 1;
+	}
 
-	/* This works well for robots.txt and favicon.ico */
-	*type = '0'; // default
-	return fd;
+	if(strncmp(real, root_dir, len)) {
+		errno = EACCES;
+		return -1;
+	}
+#else
+	// A .. at the end is safe since it will never specify a file,
+	// only a directory.
+	if(strncmp(path, "../", 3) == 0 || (int)strstr(path, "/../")) {
+		errno = EACCES;
+		return -1;
+	}
 #endif
 
-	errno = EINVAL;
-	return -1;
+	return 0;
 }
+#endif
 
 
-void close_connection(struct connection *conn, int status)
+// Log hits in one place
+static void log_request(struct connection *conn, int status)
 {
-	if(verbose > 2) printf("Close request\n");
-
-	--n_connections;
-
 	if(conn->cmd) {
 		// Make we have a clean cmd
 		char *p;
@@ -612,9 +1199,94 @@ void close_connection(struct connection *conn, int status)
 			conn->http = 1;
 	}
 
-	// Log hits in one place. Do not log stat requests.
-	if(status != 1000) {
-		log_hit(conn, status);
+	log_hit(conn, status);
+	hist_hit(stats, conn, status);
+}
+
+
+// Frees everything that belongs to the current response
+static void release_request(struct connection *conn)
+{
+	conn->len = 0;
+
+	if(conn->menu)
+		menu_release(conn);
+	else if(conn->buf) {
+		mmap_release(conn);
+		conn->buf = NULL;
+	}
+
+	if(conn->sendfd >= 0) {
+		close(conn->sendfd);
+		conn->sendfd = -1;
+	}
+
+	if(conn->http_header) {
+		free(conn->http_header);
+		conn->http_header = NULL;
+	}
+	conn->html_header  = NULL;
+	conn->html_trailer = NULL;
+
+	conn->http = 0;
+	conn->host = NULL;
+	conn->referer = NULL;
+	conn->user_agent = NULL;
+
+	conn->status = 200;
+	conn->keepalive = 0;
+	conn->first_byte = 0;
+
+	memset(conn->iovs, 0, sizeof(conn->iovs));
+}
+
+
+/* HTTP keep-alive. The response is out, so log it and go back to
+ * reading. Pipelined requests are already in cmd after this one.
+ */
+static void reset_connection(struct connection *conn)
+{
+	int left = conn->offset - conn->req_len;
+
+	log_request(conn, conn->status);
+	release_request(conn);
+	++conn->n_served;
+
+	conn->cmd[conn->req_len] = conn->req_end;
+	memmove(conn->cmd, conn->cmd + conn->req_len, left);
+	conn->cmd[left] = '\0';
+	conn->offset  = left;
+	conn->req_len = 0;
+
+	set_readable(conn, SOCKET(conn));
+	timer_set(conn, left ? read_timeout : keepalive_timeout);
+
+	if(left) {
+		conn->start = hist_clock();
+		parse_request(conn);
+	}
+}
+
+
+// The response is out
+static void request_done(struct connection *conn)
+{
+	if(conn->keepalive)
+		reset_connection(conn);
+	else
+		close_connection(conn, conn->status);
+}
+
+
+void close_connection(struct connection *conn, int status)
+{
+	if(verbose > 2) printf("Close request\n");
+
+	--stats->n_connections;
+
+	// Do not log stat requests or idle keep-alive connections
+	if(status != 1000 && (conn->offset || conn->n_served == 0)) {
+		log_request(conn, status);
 
 		// Send gopher errors in one place also
 		if(status != 200 && status != 504 && !conn->http) {
@@ -629,16 +1301,23 @@ void close_connection(struct connection *conn, int status)
 		conn->cmd = NULL;
 	}
 
-	conn->len = conn->offset = 0;
+	conn->offset = 0;
+	conn->req_len = 0;
+	conn->n_served = 0;
 
-	if(conn->buf) {
-		mmap_release(conn);
-		conn->buf = NULL;
-	}
+	timer_set(conn, 0);
+
+	release_request(conn);
 
 	if(SOCKET(conn) >= 0) {
-		close(SOCKET(conn));
-#ifdef HAVE_POLL
+#ifdef HAVE_IO_URING
+		// Before the close, the fd could be reused by the next submit
+		if(uring_active) uring_disarm(conn);
+#endif
+		close(SOCKET(conn)); // also removes it from the epoll set
+#ifdef HAVE_EPOLL
+		conn->sock = -1;
+#elif defined(HAVE_POLL)
 		conn->ufd->fd = -1;
 		conn->ufd->revents = 0;
 		while(npoll > 1 && ufds[npoll - 1].fd == -1) --npoll;
@@ -655,35 +1334,16 @@ void close_connection(struct connection *conn, int status)
 #endif
 	}
 
-	if(conn->http_header) {
-		free(conn->http_header);
-		conn->http_header = NULL;
-	}
-	if(conn->outname) {
-		if(unlink(conn->outname))
-			syslog(LOG_WARNING, "unlink %s: %m", conn->outname);
-		free(conn->outname);
-		conn->outname = NULL;
-	}
-	conn->html_header  = NULL;
-	conn->html_trailer = NULL;
-
-	conn->http = 0;
-	conn->host = NULL;
-	conn->referer = NULL;
-	conn->user_agent = NULL;
-
-	conn->status = 200;
-
-	memset(conn->iovs, 0, sizeof(conn->iovs));
-
-#ifdef HAVE_POLL
+#ifdef HAVE_EPOLL
+	if(accept_throttled) set_accepting(1);
+#elif defined(HAVE_POLL)
 	ufds[0].events = POLLIN; /* in case we throttled */
 #else
 	FD_SET(accept_sock, &readfds);  /* in case we throttled */
 #endif
 
 #ifdef CGI
+	if(conn->cgi) --stats->n_cgi;
 	conn->cgi = 0;
 #endif
 }
@@ -696,7 +1356,8 @@ int new_connection(int csock)
 	int i;
 	struct connection *conn;
 
-	seteuid(root_uid);
+	// seteuid is process wide, so threads cannot play this game
+	if(threads == 1) seteuid(root_uid);
 
 	while(1) {
 		/*
@@ -704,11 +1365,14 @@ int new_connection(int csock)
 		 * connection, throttle incoming requests and let the backlog
 		 * queue hold it.
 		 */
-		for(conn = conns, i = 0; i < max_conns; ++i, ++conn)
+		for(conn = conns, i = 0; i < n_conns; ++i, ++conn)
 			if(SOCKET(conn) == -1) break;
-		if(i == max_conns) {
+		if(i == n_conns) {
 			syslog(LOG_WARNING, "Too many connections.");
-#ifdef HAVE_POLL
+			++stats->throttled;
+#ifdef HAVE_EPOLL
+			set_accepting(0);
+#elif defined(HAVE_POLL)
 			ufds[0].events = 0;
 #else
 			FD_CLR(accept_sock, &readfds);
@@ -717,7 +1381,7 @@ int new_connection(int csock)
 		}
 
 		if((sock = accept_socket(csock, &addr)) < 0) {
-			seteuid(uid);
+			if(threads == 1) seteuid(uid);
 
 			if(errno == EWOULDBLOCK)
 				return 0;
@@ -728,81 +1392,149 @@ int new_connection(int csock)
 
 		// Set *before* any closes
 		set_readable(conn, sock);
-		++n_connections;
-		++n_requests;
-		if(i > max_requests) max_requests = i;
+		open_connection(conn, addr, i);
+	}
+}
 
-		conn->addr   = addr;
-		conn->offset = 0;
-		conn->len    = 0;
-		time(&conn->access);
 
-		if(!conn->cmd && !(conn->cmd = malloc(MAX_LINE + 1))) {
-			syslog(LOG_WARNING, "Out of memory.");
-			close_connection(conn, 503);
-		}
+/* Sets up a new connection in slot i, once its socket is set.
+ * Returns -1 if it had to be closed.
+ */
+int open_connection(struct connection *conn, unsigned addr, int i)
+{
+	++stats->n_connections;
+	++stats->n_requests;
+	if(i > stats->max_requests) stats->max_requests = i;
+
+	conn->addr   = addr;
+	conn->offset = 0;
+	conn->len    = 0;
+	conn->start  = hist_clock();
+	conn->first_byte = 0;
+	timer_set(conn, read_timeout);
+
+	if(!conn->cmd && !(conn->cmd = malloc(MAX_LINE + 1))) {
+		syslog(LOG_WARNING, "Out of memory.");
+		close_connection(conn, 503);
+		return -1;
 	}
+
+	return 0;
 }
 
 
 int read_request(struct connection *conn)
 {
-	int fd;
 	int n;
-	char *p, type;
 
-	do
-		n = read(SOCKET(conn), conn->cmd + conn->offset, MAX_LINE - conn->offset);
-	while(n < 0 && errno == EINTR);
+	// We keep reading until we have the request or get an EAGAIN.
+	// This is required for edge triggered epoll.
+	do {
+		do
+			n = read(SOCKET(conn), conn->cmd + conn->offset,
+					 MAX_LINE - conn->offset);
+		while(n < 0 && errno == EINTR);
 
-	if(n < 0) {
-		if(errno == EAGAIN) {
-			syslog(LOG_DEBUG, "EAGAIN\n");
-			return 0;
+		if(n < 0) {
+			if(errno == EAGAIN) return 0; // not an error
+
+			syslog(LOG_WARNING, "Read error (%d): %m", errno);
+			close_connection(conn, 408);
+			return 1;
 		}
+	} while((n = request_data(conn, n)) == 0);
 
-		syslog(LOG_WARNING, "Read error (%d): %m", errno);
-		close_connection(conn, 408);
-		return 1;
-	}
+	return n < 0;
+}
+
+
+/* We just read n bytes into cmd at offset. Returns 0 if we need more
+ * data, -1 if the connection was closed, else 1.
+ */
+int request_data(struct connection *conn, int n)
+{
 	if(n == 0) {
+		if(conn->offset == 0 && conn->n_served) {
+			// keep-alive client went away between requests
+			close_connection(conn, 200);
+			return -1;
+		}
 		syslog(LOG_WARNING, "Read: unexpected EOF");
 		close_connection(conn, 408);
-		return 1;
+		return -1;
+	}
+
+	// The next keep-alive request is starting
+	if(conn->offset == 0 && conn->n_served) {
+		timer_set(conn, read_timeout);
+		conn->start = hist_clock();
 	}
 
 	conn->offset += n;
-	time(&conn->access);
 
 	// We alloced an extra space for the '\0'
 	conn->cmd[conn->offset] = '\0';
 
-	if(conn->cmd[conn->offset - 1] != '\n') {
+	return parse_request(conn);
+}
+
+
+/* Looks for a complete request in cmd and starts the response.
+ * Returns 0 if we need more data, else 1.
+ */
+int parse_request(struct connection *conn)
+{
+	int fd;
+	char *p, *e, type;
+
+	if(!(e = memchr(conn->cmd, '\n', conn->offset))) {
 		if(conn->offset >= MAX_LINE) {
 			syslog(LOG_WARNING, "Line overflow");
 			if(strncmp(conn->cmd, "GET ",  4) == 0 ||
 			   strncmp(conn->cmd, "HEAD ", 5) == 0)
-				return http_error(conn, 414);
-			else {
+				http_error(conn, 414);
+			else
 				close_connection(conn, 414);
-				return 1;
-			}
+			return 1;
 		}
-		return 0; // not an error
+		return 0;
 	}
 
-	if(conn->offset > max_length) max_length = conn->offset;
+	if(conn->offset > stats->max_length) stats->max_length = conn->offset;
 
-	if(strcmp(conn->cmd, "STATS\r\n") == 0)
-		return gofish_stats(conn);
+	if(strcmp(conn->cmd, "STATS\r\n") == 0) {
+		gofish_stats(conn);
+		return 1;
+	}
+
+	// Only from this machine
+	if(strcmp(conn->cmd, "STATS RESET\r\n") == 0 &&
+	   (conn->addr & 0xff000000) == 0x7f000000) {
+		hist_reset(all_stats, workers * threads);
+		gofish_stats(conn);
+		return 1;
+	}
 
 	if(strncmp(conn->cmd, "GET ",  4) == 0 ||
 	   strncmp(conn->cmd, "HEAD ", 5) == 0) {
 		// We must look for \r\n\r\n
 		// This is mainly for telnet sessions
-		if(strstr(conn->cmd, "\r\n\r\n")) {
+		if((e = strstr(conn->cmd, "\r\n\r\n"))) {
+			// Hide any pipelined requests until this one is done
+			conn->req_len = e + 4 - conn->cmd;
+			conn->req_end = conn->cmd[conn->req_len];
+			conn->cmd[conn->req_len] = '\0';
+
+			if(conn->n_served) ++stats->n_requests;
+
 			if(verbose > 2) printf("Http: %s\n", conn->cmd);
-			return http_get(conn);
+			http_get(conn);
+			return 1;
+		}
+		if(conn->offset >= MAX_LINE) {
+			syslog(LOG_WARNING, "Header overflow");
+			http_error(conn, 414);
+			return 1;
 		}
 		conn->http = 1;
 		return 0;
@@ -811,9 +1543,9 @@ int read_request(struct connection *conn)
 	// -----------------------------------------------------------------
 	// From here on is gopher only
 
-	conn->cmd[conn->offset - 1] = '\0';
-	if(conn->offset > 1 && conn->cmd[conn->offset - 2] == '\r')
-		conn->cmd[conn->offset - 2] = '\0';
+	*e = '\0';
+	if(e > conn->cmd && *(e - 1) == '\r')
+		*(e - 1) = '\0';
 
 	if(verbose) printf("Gopher request: '%s'\n", conn->cmd);
 
@@ -827,29 +1559,29 @@ int read_request(struct connection *conn)
 			*p = '\0';
 	}
 
-	if((fd = smart_open(conn->cmd, &type)) < 0) {
+	if(open_selector(conn, conn->cmd, &type, &fd, 0)) {
 		close_connection(conn, 404);
 		return 1;
 	}
 
-	conn->len = lseek(fd, 0, SEEK_END);
-
-	if(conn->len) {
-		if((conn->buf = mmap_get(conn, fd)) == NULL) {
-			syslog(LOG_ERR, "mmap: %m");
-			close(fd);
-			close_connection(conn, 408);
-			return 1;
-		}
+	if(file_body(conn, fd, 0)) {
+		syslog(LOG_ERR, "mmap: %m");
+		close_connection(conn, 408);
+		return 1;
 	}
 
-	close(fd);
-
-	conn->iovs[0].iov_base = conn->buf;
-	conn->iovs[0].iov_len  = conn->len;
-
 	if(type == '0') {
-		if(conn->len > 0 && conn->buf[conn->len - 1] != '\n') {
+		char last = '\n';
+
+		if(conn->buf)
+			last = conn->buf[conn->len - 1];
+#ifdef USE_SENDFILE
+		else if(conn->sendfd >= 0 &&
+				pread(conn->sendfd, &last, 1, conn->len - 1) != 1)
+			last = '\n';
+#endif
+
+		if(conn->len > 0 && last != '\n') {
 			conn->iovs[1].iov_base = "\r\n.\r\n";
 			conn->iovs[1].iov_len  = 5;
 		} else {
@@ -864,15 +1596,121 @@ int read_request(struct connection *conn)
 
 	set_writeable(conn);
 
+	return 1;
+}
+
+
+/* Sets up iovs[iov] to send the file. Big files go out with
+ * sendfile and keep fd open, the rest are mmapped and fd is closed.
+ * conn->len must be the file size. If fd is -1, open_selector
+ * already found conn->buf in the mmap cache.
+ * Returns -1 if the mmap failed.
+ */
+int file_body(struct connection *conn, int fd, int iov)
+{
+	if(fd < 0) goto mapped;
+
+#ifdef USE_SENDFILE
+	if(use_sendfile(conn->len)) {
+		conn->sendfd   = fd;
+		conn->file_iov = iov;
+		conn->file_off = 0;
+		conn->iovs[iov].iov_base = NULL;
+		conn->iovs[iov].iov_len  = conn->len;
+		set_cork(SOCKET(conn), 1);
+		return 0;
+	}
+#endif
+
+	if(conn->len && (conn->buf = mmap_get(conn, fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+mapped:
+	conn->iovs[iov].iov_base = conn->buf;
+	conn->iovs[iov].iov_len  = conn->len;
+
 	return 0;
 }
 
 
+#ifdef USE_SENDFILE
+/* write_request for sendfile. The iovs before and after file_iov are
+ * written as usual, file_iov itself comes from sendfd at file_off.
+ */
+static int send_request(struct connection *conn)
+{
+	struct iovec *iov;
+	int i, n, first;
+
+	while(1) {
+		for(first = 0; first < conn->n_iovs; ++first)
+			if(conn->iovs[first].iov_len) break;
+		if(first == conn->n_iovs) break;
+
+		if(first == conn->file_iov)
+			n = send_file(SOCKET(conn), conn->sendfd, &conn->file_off,
+						  conn->iovs[first].iov_len);
+		else if(first < conn->file_iov)
+			n = writev(SOCKET(conn), conn->iovs + first,
+					   conn->file_iov - first);
+		else
+			n = writev(SOCKET(conn), conn->iovs + first,
+					   conn->n_iovs - first);
+
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) return 0;
+
+			syslog(LOG_ERR, "sendfile: %m");
+			close_connection(conn, 408);
+			return 1;
+		}
+		if(n == 0) {
+			// The file shrank under us
+			syslog(LOG_ERR, "sendfile unexpected EOF");
+			close_connection(conn, 408);
+			return 1;
+		}
+
+		timer_set(conn, write_timeout);
+		if(!conn->first_byte) conn->first_byte = hist_clock();
+		stats->bytes_sent += n;
+
+		for(iov = conn->iovs + first, i = first; n > 0 && i < conn->n_iovs;
+			++i, ++iov)
+			if(n >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov->iov_len = 0;
+			} else {
+				iov->iov_len -= n;
+				if(i != conn->file_iov) iov->iov_base += n;
+				n = 0;
+			}
+	}
+
+	// Push out anything the cork is holding
+	set_cork(SOCKET(conn), 0);
+	request_done(conn);
+
+	return 0;
+}
+#endif
+
+
 int write_request(struct connection *conn)
 {
 	int n, i;
 	struct iovec *iov;
 
+#ifdef USE_SENDFILE
+	if(conn->sendfd >= 0)
+		return send_request(conn);
+#endif
+
 	do
 		n = writev(SOCKET(conn), conn->iovs, conn->n_iovs);
 	while(n < 0 && errno == EINTR);
@@ -890,6 +1728,9 @@ int write_request(struct connection *conn)
 		return 1;
 	}
 
+	if(!conn->first_byte) conn->first_byte = hist_clock();
+	stats->bytes_sent += n;
+
 	for(iov = conn->iovs, i = 0; i < conn->n_iovs; ++i, ++iov)
 		if(n >= iov->iov_len) {
 			n -= iov->iov_len;
@@ -898,32 +1739,38 @@ int write_request(struct connection *conn)
 		else {
 			iov->iov_len -= n;
 			iov->iov_base += n;
-			time(&conn->access);
+			timer_set(conn, write_timeout);
 			return 0;
 		}
 
-	close_connection(conn, conn->status);
+	request_done(conn);
 
 	return 0;
 }
 
 
-void check_old_connections(void)
+// Called by the timer wheel when a connection misses its deadline
+void expire_connection(struct connection *conn)
 {
-	struct connection *c;
-	int i;
-	time_t checkpoint;
+#ifdef CGI
+	if(conn->cgi) {
+		syslog(LOG_WARNING, "%s: Killing CGI %d.", ntoa(conn->addr), conn->cgi);
+		kill(conn->cgi, SIGKILL);
+		waitpid(conn->cgi, NULL, 0);
+		close_connection(conn, 504);
+		return;
+	}
+#endif
 
-	checkpoint = time(NULL) - MAX_IDLE_TIME;
+	if(conn->offset == 0 && conn->n_served) {
+		// keep-alive timeout, nothing to complain about
+		close_connection(conn, 200);
+		return;
+	}
 
-	// Do not close the listen socket
-	for(c = conns, i = 0; i < max_conns; ++i, ++c)
-		if(SOCKET(c) >= 0 && c->access < checkpoint) {
-			// SAM What about http connections?
-			syslog(LOG_WARNING, "%s: Killing idle connection.", ntoa(c->addr));
-			syslog(LOG_DEBUG, "%s idle: '%s'", ntoa(c->addr), c->cmd); // SAM DBG
-			close_connection(c, 408);
-		}
+	syslog(LOG_WARNING, "%s: Killing idle connection.", ntoa(conn->addr));
+	syslog(LOG_DEBUG, "%s idle: '%s'", ntoa(conn->addr), conn->cmd); // SAM DBG
+	close_connection(conn, 408);
 }
 
 
@@ -963,65 +1810,6 @@ void create_pidfile(char *fname)
 }
 
 
-/* SAM This could be optimized */
-int open_cache(char *fname)
-{
-	FILE *fp;
-	int fd, rc;
-	char tempname[20], portstr[12];
-	char line[1024];
-
-	if(process_cache == 0) return open(fname, O_RDONLY);
-
-	if((fp = fopen(fname, "r")) == NULL) return -1;
-
-	sprintf(tempname, "%s/gocacheXXXXXX", tmpdir);
-	if((fd = mkstemp(tempname)) < 0) {
-		fclose(fp);
-		return fd;
-	}
-	unlink(tempname);
-
-	while(fgets(line, sizeof(line), fp)) {
-#define NEED_WRITE(fd, b, l)  if((rc = write(fd, b, l)) != l) goto write_failed
-		int len, fields = 1;
-		char *p;
-
-		for(p = line; *p && *p != '\n' && *p != '\r'; ++p)
-			if(*p == '\t') ++fields;
-
-		len = p - line;
-		NEED_WRITE(fd, line, len);
-
-		switch(fields) {
-		case 2: /* host missing */
-			NEED_WRITE(fd, "\t", 1);
-			NEED_WRITE(fd, hostname, strlen(hostname));
-			/* fallthru */
-		case 3: /* port missing */
-			sprintf(portstr, "\t%d", port);
-			NEED_WRITE(fd, portstr, strlen(portstr));
-		}
-
-		NEED_WRITE(fd, "\n", 1);
-	}
-
-	fclose(fp);
-	lseek(fd, 0, SEEK_SET);
-
-	return fd;
-
-write_failed:
-	if(rc < 0)
-		syslog(LOG_WARNING, "open_cache %s: write failed: %m", fname);
-	else
-		syslog(LOG_WARNING, "open_cache %s: short write", fname);
-	fclose(fp);
-	close(fd);
-	return -1;
-}
-
-
 #define SECONDS_IN_A_MINUTE	(60)
 #define SECONDS_IN_AN_HOUR	(SECONDS_IN_A_MINUTE * 60)
 #define SECONDS_IN_A_DAY	(SECONDS_IN_AN_HOUR * 24)
@@ -1045,10 +1833,52 @@ static char *uptime(char *str)
 }
 
 
+// Add up the workers and threads, all but the latencies
+static void total_stats(struct stats *total)
+{
+	struct stats *s;
+	int i, j, n_stats = workers * threads;
+
+	memset(total, 0, sizeof(struct stats));
+	for(s = all_stats, i = 0; i < n_stats; ++i, ++s) {
+		total->n_requests    += s->n_requests;
+		total->n_connections += s->n_connections;
+		total->bad_munmaps   += s->bad_munmaps;
+		total->cache_hits       += s->cache_hits;
+		total->cache_misses     += s->cache_misses;
+		total->cache_ghost_hits += s->cache_ghost_hits;
+		total->cache_evictions  += s->cache_evictions;
+		total->log_drops     += s->log_drops;
+		total->throttled     += s->throttled;
+		total->n_cgi         += s->n_cgi;
+		total->bytes_sent    += s->bytes_sent;
+		for(j = 0; j < N_CLASSES; ++j) {
+			total->n_status[0][j] += s->n_status[0][j];
+			total->n_status[1][j] += s->n_status[1][j];
+		}
+		if(s->max_requests > total->max_requests)
+			total->max_requests = s->max_requests;
+		if(s->max_length > total->max_length)
+			total->max_length = s->max_length;
+	}
+}
+
+
 static int gofish_stats(struct connection *conn)
 {
-	extern unsigned bad_munmaps;
-	char buf[200], up[12];
+	char *buf, *p, up[12];
+	static THREAD_LOCAL struct stats total;
+	struct stats *s;
+	int i, n_stats = workers * threads;
+
+	total_stats(&total);
+
+	// 350 bytes: 300 for the totals and 50 spare for a long version
+	// string, it comes from git. Plus 50 per event loop and the latencies.
+	if(!(buf = malloc(350 + n_stats * 50 + HIST_REPORT_SIZE))) {
+		close_connection(conn, 1000);
+		return 1;
+	}
 
 	sprintf(buf,
 			"GoFish " GOFISH_VERSION " %12s\r\n"
@@ -1057,17 +1887,127 @@ static int gofish_stats(struct connection *conn)
 			"Max length:   %10u\r\n"
 			"Connections:  %10d\r\n",
 			uptime(up),
-			n_requests, max_requests, max_length,
+			total.n_requests, total.max_requests, total.max_length,
 			// we are an outstanding connection
-			n_connections - 1);
+			total.n_connections - 1);
+	p = buf + strlen(buf);
+
+	if(total.bad_munmaps) {
+		sprintf(p, "BAD UNMAPS:   %10u\r\n", total.bad_munmaps);
+		p += strlen(p);
+	}
 
-	if(bad_munmaps) {
-		char *p = buf + strlen(buf);
-		sprintf(p, "BAD UNMAPS:   %10u\r\n", bad_munmaps);
+	if(total.cache_hits || total.cache_misses) {
+		sprintf(p,
+				"Cache hits:   %10u\r\n"
+				"Cache misses: %10u\r\n"
+				"Ghost hits:   %10u\r\n"
+				"Evictions:    %10u\r\n",
+				total.cache_hits, total.cache_misses,
+				total.cache_ghost_hits, total.cache_evictions);
+		p += strlen(p);
 	}
 
-	// SAM safe? It's < 150 bytes...
-	while(write(SOCKET(conn), buf, strlen(buf)) < 0 && errno == EINTR) ;
+	if(total.log_drops) {
+		sprintf(p, "Log drops:    %10u\r\n", total.log_drops);
+		p += strlen(p);
+	}
+
+	p = hist_report(p, all_stats, n_stats);
+
+	if(n_stats > 1)
+		for(s = all_stats, i = 0; i < n_stats; ++i, ++s) {
+			if(threads == 1)
+				sprintf(p, "Worker %2d: %6d %10u %6d\r\n",
+						i, (int)s->pid, s->n_requests, s->n_connections);
+			else if(workers == 1)
+				sprintf(p, "Thread %2d: %6d %10u %6d\r\n",
+						i, (int)s->pid, s->n_requests, s->n_connections);
+			else
+				sprintf(p, "Worker %2d.%d: %6d %10u %6d\r\n",
+						i / threads, i % threads,
+						(int)s->pid, s->n_requests, s->n_connections);
+			p += strlen(p);
+		}
+
+	while(write(SOCKET(conn), buf, p - buf) < 0 && errno == EINTR) ;
+
+	free(buf);
+
+	close_connection(conn, 1000);
+
+	return 0;
+}
+
+
+/* Prometheus text format, for the http metrics-path. The page is
+ * small and the socket new, so like STATS it goes out in one write.
+ * Nothing is allocated.
+ */
+#define METRIC(name, type, help) \
+	"# HELP gofish_" name " " help "\n# TYPE gofish_" name " " type "\n"
+
+int gofish_metrics(struct connection *conn)
+{
+	static THREAD_LOCAL struct stats total;
+	static char *proto[] = { "gopher", "http" };
+	char body[4096], head[160], *p = body;
+	struct iovec iov[2];
+	int i, j;
+
+	total_stats(&total);
+
+	p += sprintf(p, METRIC("requests_total", "counter",
+						   "Requests by protocol and status class."));
+	for(i = 0; i < 2; ++i)
+		for(j = 0; j < N_CLASSES; ++j)
+			p += sprintf(p, "gofish_requests_total{proto=\"%s\",code=\"%dxx\"} %llu\n",
+						 proto[i], j + 2, total.n_status[i][j]);
+
+	p += sprintf(p,
+				 METRIC("sent_bytes_total", "counter", "Bytes written to clients.")
+				 "gofish_sent_bytes_total %llu\n"
+				 METRIC("connections", "gauge", "Open connections.")
+				 "gofish_connections %d\n"
+				 METRIC("accept_throttled_total", "counter",
+						"Times accepting stopped for too many connections.")
+				 "gofish_accept_throttled_total %u\n"
+				 METRIC("mmap_cache_hits_total", "counter", "mmap cache hits.")
+				 "gofish_mmap_cache_hits_total %u\n"
+				 METRIC("mmap_cache_misses_total", "counter", "mmap cache misses.")
+				 "gofish_mmap_cache_misses_total %u\n"
+				 METRIC("mmap_cache_ghost_hits_total", "counter",
+						"mmap cache misses on recently evicted files.")
+				 "gofish_mmap_cache_ghost_hits_total %u\n"
+				 METRIC("mmap_cache_evictions_total", "counter",
+						"mmap cache evictions.")
+				 "gofish_mmap_cache_evictions_total %u\n"
+				 METRIC("bad_munmaps_total", "counter", "Failed munmaps.")
+				 "gofish_bad_munmaps_total %u\n"
+				 METRIC("log_drops_total", "counter",
+						"Log lines dropped with the async log full.")
+				 "gofish_log_drops_total %u\n"
+				 METRIC("cgi_children", "gauge", "CGI children running.")
+				 "gofish_cgi_children %d\n",
+				 total.bytes_sent,
+				 total.n_connections - 1, // not us
+				 total.throttled,
+				 total.cache_hits, total.cache_misses,
+				 total.cache_ghost_hits, total.cache_evictions,
+				 total.bad_munmaps, total.log_drops, total.n_cgi);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = sprintf(head,
+							 "HTTP/1.0 200 OK\r\n"
+							 "Content-Type: text/plain; version=0.0.4\r\n"
+							 "Content-Length: %d\r\n"
+							 "Connection: close\r\n\r\n",
+							 (int)(p - body));
+	iov[1].iov_base = body;
+	iov[1].iov_len = p - body;
+
+	while(writev(SOCKET(conn), iov, conn->http == HTTP_HEAD ? 1 : 2) < 0 &&
+		  errno == EINTR) ;
 
 	close_connection(conn, 1000);
 
@@ -1096,7 +2036,7 @@ void reap_children()
 	struct connection *conn;
 	int i;
 
-	for(conn = conns, i = 0; i < max_conns; ++i, ++conn)
+	for(conn = conns, i = 0; i < n_conns; ++i, ++conn)
 		if(conn->cgi) {
 			int rc, status;
 
@@ -22,32 +22,64 @@
 
 #include "config.h"
 
-#ifdef HAVE_POLL
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if defined(HAVE_POLL) || defined(HAVE_IO_URING)
 #include <poll.h>
 #endif
 #include <unistd.h>
 #include <time.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+
+#ifdef THREADS
+#include <pthread.h>
+#define THREAD_LOCAL	__thread
+#else
+#define THREAD_LOCAL
+#endif
 
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
 
+// We only know the Linux sendfile semantics
+#if defined(HAVE_SENDFILE) && defined(__linux__)
+#define USE_SENDFILE
+#endif
+
+#ifdef USE_SENDFILE
+#define use_sendfile(len) \
+	(sendfile_threshold > 0 && (unsigned)(len) >= sendfile_threshold)
+#else
+#define use_sendfile(len) 0
+#endif
+
 #define MAX_HOSTNAME	65
 #define MAX_LINE		1280
 #define MIN_REQUESTS	4
 #define GOPHER_BACKLOG	100 // helps when backed up
 
 /*
- * Simplistic connection timeout mechanism.
- * Every connection has a `last access time' associated with it. An
- * access is a new connection, a read, or a write. When we have been
- * idle for POLL_TIMEOUT seconds, we check all the connections. If a
- * connection has been idle for more than MAX_IDLE_TIME, we close the
- * connection.
+ * Connection timeouts. Every connection has one deadline on the timer
+ * wheel (see timer.c). It gets READ_TIMEOUT from the accept to read
+ * the request, then each write that makes progress pushes it out to
+ * WRITE_TIMEOUT. A CGI gets CGI_TIMEOUT to run. Can be overridden
+ * with config file options.
+ */
+#define READ_TIMEOUT	60	// seconds
+#define WRITE_TIMEOUT	60	// seconds
+#define CGI_TIMEOUT		60	// seconds
+
+/*
+ * HTTP keep-alive. An idle connection is closed after
+ * KEEPALIVE_TIMEOUT seconds, and after KEEPALIVE_MAX requests.
+ * A timeout of 0 turns keep-alive off. Can be overridden with config
+ * file options.
  */
-#define POLL_TIMEOUT	 1	// seconds
-#define MAX_IDLE_TIME	60	// seconds
+#define KEEPALIVE_TIMEOUT	5	// seconds
+#define KEEPALIVE_MAX		100
 
 
 // If you leave GOPHER_HOST unset, it will default to your
@@ -80,10 +112,63 @@
  */
 #define MMAP_CACHE_SIZE	1000
 
+/*
+ * The mmap cache sheds unused entries when the memory pressure
+ * (PSI some avg10) reaches this percentage. 0 turns it off.
+ * Can be overridden with config file option.
+ * This only has meaning if MMAP_CACHE defined.
+ */
+#define MMAP_CACHE_PRESSURE	10
+
+// mmap cache replacement policies (mmap-cache-policy)
+#define MMAP_LRU	0
+#define MMAP_2Q		1
+
+
+/*
+ * How long, in seconds, a resolved selector is trusted, and how many
+ * we remember. A ttl of 0 turns the selector cache off.
+ * Can be overridden with config file options.
+ */
+#define SELECTOR_CACHE_TTL	5
+#define SELECTOR_CACHE_SIZE	1000
+
+
+/*
+ * Number of menus (.cache files) kept in memory.
+ * Can be overridden with config file option.
+ */
+#define MENU_CACHE_SIZE		100
+
+
+/*
+ * Async logging (log-async). Each event loop puts its hits in a ring
+ * of LOG_BUFFER_SIZE bytes and a writer thread writes them out every
+ * LOG_FLUSH_INTERVAL milliseconds, or sooner once LOG_FLUSH_SIZE
+ * bytes are waiting. When a ring is full we drop the hit or block
+ * (log-full). Can be overridden with config file options.
+ * This only has meaning if THREADS defined.
+ */
+#define LOG_BUFFER_SIZE		(1024 * 1024)
+#define LOG_FLUSH_INTERVAL	1000
+#define LOG_FLUSH_SIZE		(64 * 1024)
+
+// log-full policies
+#define LOG_DROP	0
+#define LOG_BLOCK	1
+
+
+/*
+ * Files at least this big are sent with sendfile rather than mmapped.
+ * 0 turns sendfile off. Can be overridden with config file option.
+ * This only has meaning if USE_SENDFILE defined.
+ */
+#define SENDFILE_THRESHOLD	(64 * 1024)
+
 
 struct connection {
 	int conn_n;
-#ifdef HAVE_POLL
+#if defined(HAVE_POLL) && !defined(HAVE_EPOLL)
 	struct pollfd *ufd;
 #else
 	int sock;
@@ -94,46 +179,273 @@ struct connection {
 	unsigned len;
 	unsigned char *buf;
 	unsigned mapped;
+#ifdef MMAP_CACHE
+	struct cache *cache; // mmap cache entry for buf
+#endif
+	struct menu *menu;   // if set, buf is this menu or its page
 	int   status;
 	struct iovec iovs[4];
 	int n_iovs;
+	int sendfd;      // file being sent with sendfile, else -1
+	int file_iov;    // the iov that stands in for sendfd
+	off_t file_off;  // how far into sendfd we have sent
+
+	// latency, from hist_clock
+	long long start;
+	long long first_byte;
 
-	time_t access;
+	// timer wheel
+	time_t deadline;
+	struct connection *t_next, *t_prev;
+	unsigned char t_level, t_slot;
 
 	// http stuff
 	int http;
 #define	HTTP_GET	1
 #define HTTP_HEAD	2
+	int keepalive;   // keep the connection after this response
+	int n_served;    // keep-alive responses already sent
+	int req_len;     // length of the current request in cmd
+	char req_end;    // byte at req_len, hidden while we work
 	char *host;       // vhost only
 	char *user_agent; // combined log only
 	char *referer;    // combined log only
 	char *http_header;
 	char *html_header;
 	char *html_trailer;
-	char *outname;
 #ifdef CGI
 	pid_t cgi;
 #endif
+#ifdef HAVE_IO_URING
+	unsigned ring_gen;
+	int ring_armed;  // what we have in the ring, if anything
+	short ring_events;
+#endif
+};
+
+
+/*
+ * What a selector resolved to. The path is the file to open: the
+ * .cache for menus.
+ */
+struct selector {
+	char type;
+	char isdir;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	char *path; // MAX_LINE + 10
+};
+
+
+/*
+ * .cache.idx, written by mkcache -i next to a .cache. The server maps
+ * it instead of reading and parsing the .cache. It is only used if
+ * it was built from the .cache as it is now, for our host and port.
+ * Offsets are from the start of the file, in host byte order.
+ */
+#define IDX_MAGIC		"GoFishIx"
+#define IDX_VERSION		1
+
+struct idx_header {
+	char magic[8];
+	unsigned version;
+	unsigned port;
+	char host[MAX_HOSTNAME];  // the menu is expanded for host and port
+	long long mtime;          // of the .cache
+	long long size;
+	unsigned menu_off;        // the menu, host and port filled in
+	unsigned menu_len;
+	unsigned sel_off;         // n_sels idx_sel sorted on selector
+	unsigned n_sels;
+};
+
+struct idx_sel {
+	unsigned off;  // the selector without the type, e.g. sub/a.txt
+	unsigned len;
+	unsigned type; // the item type
+};
+
+
+/*
+ * Binary access log (binary-log), turned back into text by
+ * gofish-logcat. The strings are interned: a string is written once
+ * with an id and hits refer to the id. Ids belong to a stream, one
+ * per writing process, and a stream starts over in every file, so a
+ * rotated log stands on its own. An id may be given a new string; it
+ * means the new one from then on. Host byte order.
+ */
+#define BLOG_MAGIC		"GoFishLg"
+#define BLOG_VERSION	1
+#define BLOG_STRINGS	4096   // ids are 1 to BLOG_STRINGS, 0 is none
+
+// Every record starts with this
+struct blog_rec {
+	unsigned char type;
+	unsigned char flags;   // hits only
+	unsigned short len;    // of the whole record
+	unsigned stream;
+};
+
+#define BLOG_START	'V'  // a stream starts, forget its strings
+#define BLOG_STRING	'S'
+#define BLOG_HIT	'H'
+
+// hit flags
+#define BLOG_HTTP	1
+#define BLOG_HEAD	2
+
+struct blog_start {
+	struct blog_rec rec;
+	char magic[8];
+	unsigned version;
+};
+
+struct blog_string {
+	struct blog_rec rec;
+	unsigned id;           // the chars follow, no '\0'
+};
+
+struct blog_hit {
+	struct blog_rec rec;
+	long long time;
+	unsigned addr;
+	unsigned status;
+	unsigned length;
+	unsigned sel;          // as in the text log, e.g. "sub HTTP/1.0"
+	unsigned host;         // virtual host
+	unsigned referer;      // only with combined-log
+	unsigned agent;
+};
+
+
+/*
+ * Latency histograms, in microseconds. Log-linear: exact below 16,
+ * then 16 buckets per power of 2, so a value is within 1/16 of its
+ * bucket. The last bucket holds everything from about 70 minutes up.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_BUCKETS	((32 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	unsigned count[HIST_BUCKETS];
+};
+
+// accept, or the start of a keep-alive request, to
+#define LAT_FIRST	0   // the first byte of the response
+#define LAT_DONE	1   // the response is out
+#define N_LATS		2
+
+#define N_CLASSES	4   // status 2xx to 5xx
+
+
+/*
+ * Per worker statistics. With workers, these live in shared memory
+ * so any worker can report the totals.
+ */
+struct stats {
+	pid_t    pid;
+	unsigned n_requests;
+	unsigned max_requests;
+	unsigned max_length;
+	int      n_connections; // yes signed, I want to know if it goes -ve
+	unsigned bad_munmaps;
+	unsigned cache_hits;       // mmap cache
+	unsigned cache_misses;
+	unsigned cache_ghost_hits;
+	unsigned cache_evictions;
+	unsigned log_drops;        // async log ring full
+	unsigned throttled;        // accepts stopped, too many connections
+	int      n_cgi;            // CGI children running
+	unsigned long long bytes_sent;
+	unsigned long long n_status[2][N_CLASSES]; // [http][status class]
+	struct hist lat[2][N_CLASSES][N_LATS]; // [http][status class]
 };
 
 
 // exported from gopherd.c
 extern int verbose;
+extern THREAD_LOCAL struct stats *stats;
 
 void close_connection(struct connection *conn, int status);
 int checkpath(char *path);
+int file_body(struct connection *conn, int fd, int iov);
+int gofish_metrics(struct connection *conn);
+
+// exported from menu.c
+void menu_init(void);
+unsigned char *menu_find(struct connection *conn, struct selector *sel);
+unsigned char *menu_get(struct connection *conn, char *path, int fd,
+						struct stat *sbuf);
+void menu_release(struct connection *conn);
+unsigned char *menu_html(struct connection *conn, char *url);
+unsigned char *menu_html_set(struct connection *conn, char *html, int len);
+int menu_type(char *cache, char *name);
+
+// exported from selector.c
+void sel_init(void);
+int sel_find(char *name, struct selector *sel);
+void sel_add(char *name, struct selector *sel);
+int smart_open(char *name, char *type, char *path);
+int open_selector(struct connection *conn, char *name, char *type,
+				  int *fd, int head);
+int is_dir(char *name);
+
+// exported from timer.c
+extern THREAD_LOCAL time_t now;
+
+void timer_init(void);
+void timer_set(struct connection *conn, int when);
+void timer_run(void (*expire)(struct connection *conn));
+int timer_next(void);
+
+// exported from hist.c
+long long hist_clock(void);
+void hist_add(struct hist *h, long long usecs);
+unsigned hist_total(struct hist *h);
+unsigned hist_value(struct hist *h, unsigned per_mille);
+void hist_hit(struct stats *s, struct connection *conn, int status);
+char *hist_report(char *p, struct stats *all, int n_stats);
+void hist_reset(struct stats *all, int n_stats);
+#define HIST_REPORT_SIZE	((N_CLASSES * N_LATS * 2 + 1) * 70)
 
 // exported from log.c
 extern int  log_open(char *log_name);
 extern void log_hit(struct connection *conn, unsigned status);
 extern void log_close(void);
+extern void log_reopen(int sig);
+extern void log_start(void);
 extern void send_error(struct connection *conn, unsigned error);
 
 // exported from socket.c
 int listen_socket(int port);
 int accept_socket(int sock, unsigned *addr);
+int peer_addr(int sock, unsigned *addr);
 char *ntoa(unsigned n); // helper
 void set_listen_address(char *addr);
+void set_reuseport(int on);
+int is_reuseport(void);
+void set_cork(int sock, int on);
+int send_file(int sock, int fd, off_t *offset, unsigned len);
+
+// exported from dotcache.c (mkcache and gofish-corpus)
+extern int verbose;
+extern int recurse;
+extern int sorttype;
+extern int make_idx;
+extern int jobs;
+int process_dir(char *path, int level);
+void process_tree(char *path, int level);
+
+// exported from client.c (webtest and gofish-bench)
+int connect_socket(int port, unsigned addr);
+int connect_start(int port, unsigned addr);
+unsigned gethostaddr(char *hostname);
+int gopher_status(char *buf);
+int http_status(char *buf);
+int gopher_reply(int sock, char *buf, int size);
+int http_reply(int sock, char *buf, int size);
 
 
 // exported from config.c
@@ -152,15 +464,38 @@ extern int   icon_width;
 extern int   icon_height;
 extern int   virtual_hosts;
 extern int   combined_log;
+extern int   binary_log;
 extern int   is_gopher;
 extern int   htmlizer;
+extern char *metrics_path;
 extern int   max_conns;
 extern int   process_cache;
+extern int   workers;
+extern int   threads;
+extern int   read_timeout;
+extern int   write_timeout;
+extern int   cgi_timeout;
+extern int   sendfile_threshold;
+extern int   keepalive_timeout;
+extern int   keepalive_max;
+extern unsigned long mmap_cache_bytes;
+extern unsigned long mmap_cache_rss;
+extern int   mmap_cache_pressure;
+extern int   mmap_cache_policy;
+extern int   selector_cache_ttl;
+extern int   selector_cache_size;
+extern int   menu_cache_size;
+extern int   log_async;
+extern unsigned long log_buffer_size;
+extern int   log_flush_interval;
+extern unsigned long log_flush_size;
+extern int   log_full;
 
 
 int read_config(char *fname);
 char *must_strdup(char *str);
 char *must_alloc(int size);
+void must_strtosize(char *str, unsigned long *value);
 
 
 // exported from http.c
@@ -170,6 +505,17 @@ int http_get(struct connection *conn);
 int http_send_response(struct connection *conn);
 int http_error(struct connection *conn, int status);
 void http_set_header(char *fname, int header);
+void unquote(char *str);
+int http_directory(struct connection *conn, char *dir);
+
+// A page being rendered in memory
+struct page {
+	char *buf;
+	int len, size;
+	int oom;
+};
+
+void http_dir_line(struct page *pg, char *line, int len);
 #ifdef CGI
 void reap_children(void);
 #endif
@@ -183,16 +529,47 @@ void mime_cleanup(void);
 
 // exported from mmap_cache.c
 void mmap_init(void);
+void mmap_pressure_init(void);
 unsigned char *mmap_get(struct connection *conn, int fd);
+unsigned char *mmap_find(struct connection *conn, struct selector *sel);
 void mmap_release(struct connection *conn);
+void *mmap_shared(int size);
 int READ(int handle, char *whereto, int len);
 int WRITE(int handle, char *whereto, int len);
 
 
-#ifdef HAVE_POLL
+#ifdef HAVE_IO_URING
+// exported from uring.c
+#define URING_IGNORE	(~0ULL)
+
+int uring_init(unsigned entries);
+void uring_exit(void);
+int uring_poll_add(int fd, unsigned events, unsigned long long data, int multi);
+int uring_poll_remove(unsigned long long data);
+int uring_accept(int fd, unsigned long long data, int multi);
+int uring_recv(int fd, void *buf, unsigned len, unsigned long long data);
+int uring_cancel(unsigned long long data);
+int uring_submit(void);
+int uring_wait(int timeout);
+int uring_next(unsigned long long *data, int *res, int *more);
+#endif
+
+
+#ifdef HAVE_EPOLL
+
+#define SOCKET(c)	((c)->sock)
+
+void set_readable(struct connection *conn, int sock);
+void set_writeable(struct connection *conn);
+
+#elif defined(HAVE_POLL)
 
 #define SOCKET(c)	((c)->ufd->fd)
 
+#ifdef HAVE_IO_URING
+void set_readable(struct connection *conn, int sock);
+void set_writeable(struct connection *conn);
+#else
 #define set_readable(c, sock) \
 	do { \
 		(c)->ufd->fd = sock; \
@@ -202,6 +579,7 @@ int WRITE(int handle, char *whereto, int len);
 
 #define set_writeable(c) \
 	(c)->ufd->events = POLLOUT
+#endif
 
 #else
 
@@ -210,6 +588,7 @@ int WRITE(int handle, char *whereto, int len);
 #define set_readable(c, sock) \
 	do { \
 		(c)->sock = sock; \
+		FD_CLR(sock, &writefds); \
 		FD_SET(sock, &readfds); \
 		if(sock + 1 > nfds) nfds = sock + 1; \
 	} while(0)
@@ -56,6 +56,7 @@ rm -rf $RPM_BUILD_ROOT
 /usr/sbin/gofish
 /usr/sbin/gopherd
 /usr/bin/mkcache
+/usr/bin/gofish-logcat
 /usr/bin/gmap2cache
 /usr/bin/check-files
 /etc/rc.d/init.d/gopherd
@@ -0,0 +1,174 @@
+/*
+ * hist.c - latency histograms for the gofish gopher daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Each event loop counts its requests into fixed histograms in its
+ * stats, so adding a sample is a couple of shifts and an increment.
+ * STATS adds up the loops and reports the percentiles.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gofish.h"
+
+#define SUB		(1 << HIST_SUB_BITS)
+
+
+long long hist_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int bucket(long long usecs)
+{
+	unsigned v;
+	int e;
+
+	if(usecs < SUB) return usecs < 0 ? 0 : usecs;
+	v = usecs > 0xffffffffLL ? 0xffffffff : usecs;
+
+	e = 31 - __builtin_clz(v); // >= HIST_SUB_BITS
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((v >> (e - HIST_SUB_BITS)) & (SUB - 1));
+}
+
+
+// The highest value that goes in bucket i
+static unsigned bucket_max(int i)
+{
+	int shift;
+
+	if(i < SUB) return i;
+
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return ((unsigned)(SUB + (i & (SUB - 1))) << shift) + (1U << shift) - 1;
+}
+
+
+void hist_add(struct hist *h, long long usecs)
+{
+	++h->count[bucket(usecs)];
+}
+
+
+unsigned hist_total(struct hist *h)
+{
+	unsigned total = 0;
+	int i;
+
+	for(i = 0; i < HIST_BUCKETS; ++i)
+		total += h->count[i];
+	return total;
+}
+
+
+/* The value per_mille of the samples are at or below, e.g. 990 for
+ * p99. Rounded up to the top of its bucket.
+ */
+unsigned hist_value(struct hist *h, unsigned per_mille)
+{
+	unsigned long long want, seen = 0;
+	int i;
+
+	want = ((unsigned long long)hist_total(h) * per_mille + 999) / 1000;
+	if(want == 0) want = 1;
+
+	for(i = 0; i < HIST_BUCKETS - 1 && seen + h->count[i] < want; ++i)
+		seen += h->count[i];
+
+	return bucket_max(i);
+}
+
+
+// Counts a request by status and its latency. Call when it is logged.
+void hist_hit(struct stats *s, struct connection *conn, int status)
+{
+	struct hist *lat;
+	int class = status / 100 - 2;
+
+	if(class < 0) return;
+	if(class >= N_CLASSES) class = N_CLASSES - 1;
+
+	++s->n_status[conn->http ? 1 : 0][class];
+
+	if(conn->start == 0) return;
+
+	lat = s->lat[conn->http ? 1 : 0][class];
+	if(conn->first_byte)
+		hist_add(&lat[LAT_FIRST], conn->first_byte - conn->start);
+	hist_add(&lat[LAT_DONE], hist_clock() - conn->start);
+
+	conn->start = 0;
+}
+
+
+/* Writes a line of percentiles for every histogram with samples.
+ * Needs HIST_REPORT_SIZE. Returns the new end of p.
+ */
+char *hist_report(char *p, struct stats *all, int n_stats)
+{
+	static char *proto[] = { "gopher", "http" };
+	static char *lat_name[] = { "first", "done" };
+	static unsigned q[] = { 500, 900, 990, 999 }; // per mille
+	static THREAD_LOCAL struct hist sum;
+	unsigned total;
+	int http, class, lat, i, j, n;
+	int header = 0;
+
+	for(http = 0; http < 2; ++http)
+		for(class = 0; class < N_CLASSES; ++class)
+			for(lat = 0; lat < N_LATS; ++lat) {
+				memset(&sum, 0, sizeof(sum));
+				for(n = 0; n < n_stats; ++n)
+					for(i = 0; i < HIST_BUCKETS; ++i)
+						sum.count[i] += all[n].lat[http][class][lat].count[i];
+				if((total = hist_total(&sum)) == 0) continue;
+
+				if(!header) {
+					p += sprintf(p, "Latency (us)      %8s %8s %8s %8s %8s\r\n",
+								 "count", "p50", "p90", "p99", "p99.9");
+					header = 1;
+				}
+
+				p += sprintf(p, "%-6s %dxx %-5s  %8u", proto[http],
+							 class + 2, lat_name[lat], total);
+				for(j = 0; j < 4; ++j)
+					p += sprintf(p, " %8u", hist_value(&sum, q[j]));
+				p += sprintf(p, "\r\n");
+			}
+
+	return p;
+}
+
+
+// A sample from a loop can race with this and survive. That's OK.
+void hist_reset(struct stats *all, int n_stats)
+{
+	int n;
+
+	for(n = 0; n < n_stats; ++n)
+		memset(all[n].lat, 0, sizeof(all[n].lat));
+}
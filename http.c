@@ -34,7 +34,6 @@
 
 // Does not always return errors
 // Does not proxy external links
-// Maybe implement buffering in write_out
 // Better binary mime handling
 // Better image mime handling
 
@@ -66,9 +65,7 @@ static int html_set_trailer = 0;
 #define HTML_INDEX_TYPE	mime_html
 
 
-extern int smart_open(char *name, char *type);
 
-static int isdir(char *name);
 
 static int go_chdir(const char *path);
 
@@ -76,19 +73,7 @@ static int go_chdir(const char *path);
 static int cgi(struct connection *conn, char *request);
 #endif
 
-inline int write_out(int fd, char *buf, int len)
-{
-	return WRITE(fd, buf, len);
-}
-
-
-inline int write_str(int fd, char *str)
-{
-	return write_out(fd, str, strlen(str));
-}
-
-
-static void unquote(char *str)
+void unquote(char *str)
 {
 	char *p, quote[3], *e;
 	int n;
@@ -204,6 +189,7 @@ static int http_error1(struct connection *conn, int status, char *request)
 	}
 
 	conn->status = status;
+	conn->keepalive = 0; // no Content-Length
 
 	conn->iovs[0].iov_base = conn->http_header;
 	conn->iovs[0].iov_len  = strlen(conn->http_header);
@@ -229,8 +215,10 @@ static int http_build_response(struct connection *conn, char *type)
 
 	strcpy(str, "HTTP/1.1 200 OK\r\n");
 	strcat(str, server_str);
-	// SAM We do not support persistant connections
-	strcat(str, "Connection: close\r\n");
+	if(conn->keepalive)
+		strcat(str, "Connection: keep-alive\r\n");
+	else
+		strcat(str, "Connection: close\r\n");
 	p = str;
 	if(type) {
 		p += strlen(p);
@@ -255,24 +243,52 @@ static int http_build_response(struct connection *conn, char *type)
 }
 
 
-static int http_dir_line(int out, char *line)
+static void put(struct page *pg, char *str, int len)
+{
+	if(pg->len + len > pg->size) {
+		int size = pg->size * 2 + len;
+		char *new;
+
+		if(pg->oom || !(new = realloc(pg->buf, size))) {
+			pg->oom = 1;
+			return;
+		}
+		pg->buf = new;
+		pg->size = size;
+	}
+	memcpy(pg->buf + pg->len, str, len);
+	pg->len += len;
+}
+
+#define put_str(pg, str) put(pg, str, strlen(str))
+
+
+static int field_is(char *field, int len, char *str)
+{
+	return len == strlen(str) && memcmp(field, str, len) == 0;
+}
+
+
+/* The line is part of the cached menu: it is not nul terminated and
+ * must not be written to.
+ */
+void http_dir_line(struct page *pg, char *line, int len)
 {
-	char *desc, *url, *host, *port;
-	char *p, *icon;
+	char *field[4], *p, *end = line + len, *icon;
+	int flen[4], i;
 	char buf[200];
 
-	for(desc = p = line + 1; *p && *p != '\t'; ++p) ;
-	*p++ = '\0';
-	for(url = p; *p && *p != '\t'; ++p) ;
-	*p++ = '\0';
-	for(host = p; *p && *p != '\t'; ++p) ;
-	*p++ = '\0';
-	for(port = p; *p && *p != '\t'; ++p) ;
-	*p++ = '\0';
+	// desc, url, host, port
+	for(p = line + 1, i = 0; i < 4; ++i) {
+		field[i] = p;
+		while(p < end && *p != '\t') ++p;
+		flen[i] = p - field[i];
+		if(p < end) ++p;
+	}
 
 	if(*line == 'i') {
-		write_str(out, line + 1);
-		write_str(out, "<br>\n");
+		put(pg, field[0], flen[0]);
+		put_str(pg, "<br>\n");
 	} else {
 		switch(*line) {
 		case '0': icon = "text"; break;
@@ -287,63 +303,56 @@ static int http_dir_line(int out, char *line)
 				"<img src=\"/g/icons/gopher_%s.gif\" "
 				"width=%d height=%d alt=\"[%s]\">\n ",
 				icon, icon_width, icon_height, icon);
-		write_str(out, buf);
+		put_str(pg, buf);
 
-		if(strcmp(host, hostname) && strcmp(host, "localhost")) {
-			if(strcmp(port, "70") == 0)
-				sprintf(buf, "gopher://%.40s/", host);
+		if(!field_is(field[2], flen[2], hostname) &&
+		   !field_is(field[2], flen[2], "localhost")) {
+			if(field_is(field[3], flen[3], "70"))
+				sprintf(buf, "gopher://%.*s/",
+						flen[2] < 40 ? flen[2] : 40, field[2]);
 			else
-				sprintf(buf, "gopher://%.40s:%s/", host, port);
-			if(*line == '1' && (strcmp(url, "/") == 0 || !*url)) {
+				sprintf(buf, "gopher://%.*s:%.*s/",
+						flen[2] < 40 ? flen[2] : 40, field[2],
+						flen[3] < 10 ? flen[3] : 10, field[3]);
+			if(*line == '1' &&
+			   (field_is(field[1], flen[1], "/") || flen[1] == 0)) {
 			} else {
 				p = buf + strlen(buf);
-				sprintf(p, "%c%.80s", *line, url);
+				sprintf(p, "%c%.*s", *line,
+						flen[1] < 80 ? flen[1] : 80, field[1]);
 			}
-			write_str(out, desc);
-			write_str(out, " <a href=\"");
-			write_str(out, buf);
-			write_str(out, "\">");
-			write_str(out, buf);
-			write_str(out, "</a><br>\n");
+			put(pg, field[0], flen[0]);
+			put_str(pg, " <a href=\"");
+			put_str(pg, buf);
+			put_str(pg, "\">");
+			put_str(pg, buf);
+			put_str(pg, "</a><br>\n");
 		} else {
-			write_str(out, "<a href=\"/");
+			put_str(pg, "<a href=\"/");
 #ifdef STRICT_GOPHER
-			write_out(out, line, 1);
-			write_str(out, url + 1);
+			put(pg, line, 1);
+			if(flen[1] > 1) put(pg, field[1] + 1, flen[1] - 1);
 #else
-			write_str(out, url + 2);
+			if(flen[1] > 2) put(pg, field[1] + 2, flen[1] - 2);
 #endif
-			write_str(out, "\">");
-			write_str(out, desc);
-			write_str(out, "</a><br>\n");
+			put_str(pg, "\">");
+			put(pg, field[0], flen[0]);
+			put_str(pg, "</a><br>\n");
 		}
 	}
-
-	return 0;
 }
 
 
-#define BUFSIZE		2048
-
-// return the outfd or -1 for error
-static int http_directory(struct connection *conn, int fd, char *dir)
+/* Renders the menu in conn->buf as a page and sends that instead.
+ * The page is kept with the menu, so we only render it once per
+ * .cache. Returns -1 if we are out of memory.
+ */
+int http_directory(struct connection *conn, char *dir)
 {
-	int out;
-	char buffer[BUFSIZE + 1], outname[20];
+	struct page pg;
 	char url[256];
-	char *buf, *p, *s;
-	int n, len, left;
-
-
-	sprintf(outname, ".gofish-XXXXXX");
-	if((out = mkstemp(outname)) == -1) {
-		syslog(LOG_ERR, "%s: %m", outname);
-		return -1;
-	}
-	if((conn->outname = strdup(outname)) == NULL) {
-		syslog(LOG_ERR, "Out of memory");
-		return -1;
-	}
+	char *p, *s, *end;
+	int len;
 
 	if(*dir == '/') ++dir;
 	if(strncmp(dir, "1/", 2) == 0) dir += 2;
@@ -351,59 +360,56 @@ static int http_directory(struct connection *conn, int fd, char *dir)
 	p = url + strlen(url);
 	if(*(p - 1) != '/') strcpy(p, "/");
 
-	sprintf(buffer,
+	if(menu_html(conn, url)) return 0;
+
+	// Roughly what the markup adds per line
+	pg.size = conn->len * 4 + 1024;
+	pg.len = pg.oom = 0;
+	if(!(pg.buf = malloc(pg.size))) return -1;
+
+	put_str(&pg,
 			"<!DOCTYPE HTML PUBLIC "
 			"\"-//W3C//DTD HTML 4.01 Transitional//EN\">\n"
 			"<html lang=\"en\">\n"
-			"<head>\n<title>%.80s</title>\n"
+			"<head>\n<title>");
+	put(&pg, url, strlen(url) < 80 ? strlen(url) : 80);
+	put_str(&pg, "</title>\n"
 			"<style type=\"text/css\">\n"
-			"<!--\nBODY { margin: 1em 10%%; }\n-->\n</style>\n"
+			"<!--\nBODY { margin: 1em 10%; }\n-->\n</style>\n"
 			"</head>\n"
 			"<body>\n"
-			"<h1>Index of %s</h1>\n"
-			"<hr>\n<p>",
-			url, url);
-	write_str(out, buffer);
-
-
-	buf = buffer;
-	len = BUFSIZE;
-	while((n = READ(fd, buf, len)) > 0) {
-		buf[n] = '\0';
-		for(s = buffer; (p = strchr(s, '\n')); s = p) {
-			if(p > buffer && *(p - 1) == '\r') *(p - 1) = '\0';
-			*p++ = '\0';
-
-			http_dir_line(out, s); // do it
-		}
-
-		if(s == buffer) {
-			syslog(LOG_WARNING, "%s: line too long", dir);
-			return -1;
-		}
-
-		// Move the leftover bytes down
-		left = n - (s - buf);
-		memmove(buffer, s, left);
-
-		// update for next read
-		buf = buffer + left;
-		len = BUFSIZE - left;
+			"<h1>Index of ");
+	put_str(&pg, url);
+	put_str(&pg, "</h1>\n<hr>\n<p>");
+
+	s = (char *)conn->buf;
+	end = s + conn->len;
+	while(s < end) {
+		if(!(p = memchr(s, '\n', end - s))) p = end;
+		len = p - s;
+		if(len > 0 && s[len - 1] == '\r') --len;
+		if(len > 0)
+			http_dir_line(&pg, s, len);
+		s = p + 1;
 	}
 
-	if(n < 0) {
-		syslog(LOG_ERR, "%s: read error", dir);
+	put_str(&pg, "<hr>\n"
+			"<small>"
+			"<a href=\"http://gofish.sourceforge.net/\">"
+			"GoFish " GOFISH_VERSION
+			"</a> gopher to http gateway.</small>\n"
+			"</body>\n</html>\n");
+
+	// The url goes after the page for menu_html
+	len = pg.len;
+	put(&pg, url, strlen(url) + 1);
+	if(pg.oom) {
+		syslog(LOG_WARNING, "%s: out of memory", dir);
+		free(pg.buf);
 		return -1;
 	}
 
-	write_str(out, "<hr>\n"
-			  "<small>"
-			  "<a href=\"http://gofish.sourceforge.net/\">"
-			  "GoFish " GOFISH_VERSION
-			  "</a> gopher to http gateway.</small>\n"
-			  "</body>\n</html>\n");
-
-	return out;
+	return menu_html_set(conn, pg.buf, len) ? 0 : -1;
 }
 
 struct mark {
@@ -415,15 +421,38 @@ struct mark {
 #define MRESTORE(m) *(m)->pos = (m)->data
 
 
+/* Does the client want to keep the connection? version points to
+ * the HTTP/1.x of the request line, the headers follow it.
+ */
+static int http_keepalive(char *version)
+{
+	char *p;
+	int keep = strncmp(version, "HTTP/1.1", 8) == 0;
+
+	for(p = strchr(version, '\n'); p && *++p != '\r' && *p != '\n';
+		p = strchr(p, '\n'))
+		if(strncasecmp(p, "Connection:", 11) == 0) {
+			for(p += 11; *p == ' ' || *p == '\t'; ++p) ;
+			if(strncasecmp(p, "close", 5) == 0)
+				keep = 0;
+			else if(strncasecmp(p, "keep-alive", 10) == 0)
+				keep = 1;
+		}
+
+	return keep;
+}
+
+
 int http_get(struct connection *conn)
 {
 	char *e;
-	int fd, new;
+	int fd, new, head;
 	char *mime, type;
 	struct mark save;
 	char *request = conn->cmd;
 
 	conn->http = *request == 'H' ? HTTP_HEAD : HTTP_GET;
+	head = conn->http == HTTP_HEAD;
 
 	// This works for both GET and HEAD
 	request += 4;
@@ -433,6 +462,9 @@ int http_get(struct connection *conn)
 		// probably a local lynx request
 		return http_error(conn, 400);
 
+	conn->keepalive = keepalive_timeout > 0 &&
+		conn->n_served + 1 < keepalive_max && http_keepalive(e);
+
 	while(*(e - 1) == ' ') --e;
 	MSAVE(&save, e);
 	*e++ = '\0';
@@ -441,6 +473,11 @@ int http_get(struct connection *conn)
 
 	unquote(request);
 
+	if(metrics_path && strcmp(request, metrics_path) == 0) {
+		MRESTORE(&save);
+		return gofish_metrics(conn);
+	}
+
 	if(combined_log) {
 		// Save these up front for logging
 		conn->referer = strstr(e, "Referer:");
@@ -448,15 +485,12 @@ int http_get(struct connection *conn)
 	}
 
 	if(is_gopher) {
-		if((fd = smart_open(request, &type)) >= 0) {
+		if(open_selector(conn, request, &type, &fd, head) == 0) {
 			// valid gopher request
 			if(verbose) printf("HTTP Gopher request '%s'\n", request);
  			switch(type) {
 			case '1':
-				new = http_directory(conn, fd, request);
-				close(fd);
-				fd = new;
-				if(fd < 0) {
+				if(http_directory(conn, request)) {
 					MRESTORE(&save);
 					return http_error(conn, 500);
 				}
@@ -547,7 +581,7 @@ int http_get(struct connection *conn)
 		else if(verbose) printf("Http request '%s'\n", request);
 
 		if(*request) {
-			if(isdir(request)) {
+			if(is_dir(request)) {
 				char dirname[MAX_LINE + 20], *p;
 
 				strcpy(dirname, request);
@@ -560,28 +594,26 @@ int http_get(struct connection *conn)
 					return rc;
 				}
 				strcpy(p, HTML_INDEX_FILE);
-				fd = open(dirname, O_RDONLY);
+				new = open_selector(conn, dirname, &type, &fd, head);
 				mime = HTML_INDEX_TYPE;
 			} else {
-				fd = open(request, O_RDONLY);
+				new = open_selector(conn, request, &type, &fd, head);
 				mime = mime_find(request);
 			}
 		} else {
-			fd = open(HTML_INDEX_FILE, O_RDONLY);
+			new = open_selector(conn, HTML_INDEX_FILE, &type, &fd, head);
 			mime = HTML_INDEX_TYPE;
 		}
-	}
 
-	if(fd < 0) {
-		syslog(LOG_WARNING, "%s: %m", request);
-		MRESTORE(&save);
-		return http_error(conn, 404);
+		if(new) {
+			syslog(LOG_WARNING, "%s: %m", request);
+			MRESTORE(&save);
+			return http_error(conn, 404);
+		}
 	}
 
 	MRESTORE(&save);
 
-	conn->len = lseek(fd, 0, SEEK_END);
-
 	if(http_build_response(conn, mime)) {
 		syslog(LOG_WARNING, "Out of memory");
 		return -1;
@@ -590,9 +622,9 @@ int http_get(struct connection *conn)
 	conn->iovs[0].iov_base = conn->http_header;
 	conn->iovs[0].iov_len  = strlen(conn->http_header);
 
-	if(conn->http == HTTP_HEAD) {
+	if(head) {
 		// no body to send
-		close(fd);
+		if(fd >= 0) close(fd);
 
 		conn->len = 0;
 		conn->n_iovs = 1;
@@ -601,12 +633,8 @@ int http_get(struct connection *conn)
 		return 0;
 	}
 
-	conn->buf = mmap_get(conn, fd);
-
-	close(fd); // done with this
-
-	// Zero length files will fail
-	if(conn->buf == NULL && conn->len) {
+	// Closes fd unless it is going out with sendfile
+	if(file_body(conn, fd, 2)) {
 		syslog(LOG_ERR, "mmap: %m");
 		return http_error(conn, 500);
 	}
@@ -616,11 +644,6 @@ int http_get(struct connection *conn)
 		conn->iovs[1].iov_len  = strlen(conn->html_header);
 	}
 
-	if(conn->buf) {
-		conn->iovs[2].iov_base = conn->buf;
-		conn->iovs[2].iov_len  = conn->len;
-	}
-
 	if(conn->html_trailer) {
 		conn->iovs[3].iov_base = conn->html_trailer;
 		conn->iovs[3].iov_len  = strlen(conn->html_trailer);
@@ -640,15 +663,6 @@ int http_get(struct connection *conn)
 }
 
 
-static int isdir(char *name)
-{
-	struct stat sbuf;
-
-	if(stat(name, &sbuf) == -1) return 0;
-	return S_ISDIR(sbuf.st_mode);
-}
-
-
 int http_init()
 {
 	char str[600];
@@ -904,6 +918,9 @@ int cgi(struct connection *conn, char *request)
 	}
 
 	conn->cgi = child;
+	++stats->n_cgi;
+	conn->keepalive = 0; // the child owns the response
+	timer_set(conn, cgi_timeout);
 
 	return 0;
 }
@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -34,17 +35,538 @@
 static FILE *log_fp;
 static char *log_name;
 
-static void log_reopen(int sig)
+/*
+ * The signal just flags the reopen; the next write does it. Another
+ * thread, or the code we interrupted, may be in the middle of a
+ * write. With async logging it is the writer that does it.
+ */
+static volatile sig_atomic_t reopen_pending;
+
+// What we log about a hit. str[i] is NULL if we have none.
+enum { SEL, HOST, REFERER, AGENT, N_STRS };
+
+struct hit {
+	time_t time;
+	unsigned addr;
+	unsigned status;
+	unsigned length;
+	int flags;              // BLOG_HTTP, BLOG_HEAD
+	char *str[N_STRS];
+	int len[N_STRS];
+};
+
+#define MAX_REC		(MAX_LINE + 800)
+
+
+/* Binary log writing. Only one thread at a time does this, under the
+ * log lock or in the async writer.
+ */
+static struct {
+	char *str;
+	int len;
+} strs[BLOG_STRINGS];
+static int new_stream = 1;
+static unsigned stream;
+static char *blog_buf;
+static int blog_len, blog_size;
+
+
+static void blog_put(void *data, int len)
+{
+	if(blog_len + len > blog_size) {
+		int size = blog_size ? blog_size : 64 * 1024;
+		char *new;
+
+		while(size < blog_len + len) size <<= 1;
+		if(!(new = realloc(blog_buf, size))) {
+			syslog(LOG_ERR, "log: out of memory");
+			return;
+		}
+		blog_buf = new;
+		blog_size = size;
+	}
+
+	memcpy(blog_buf + blog_len, data, len);
+	blog_len += len;
+}
+
+
+// FNV-1a
+static unsigned hash_str(char *str, int len)
 {
-	fclose(log_fp);
+	unsigned h = 2166136261U;
+
+	while(len-- > 0) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+// Each field has its own range of ids
+#define FIELD_STRINGS	(BLOG_STRINGS / N_STRS)
+
+/* Returns the id for str, writing it out first if this file has not
+ * seen it. Each string has one slot it can live in; a different
+ * string for the slot takes over the id. The fields of a hit are in
+ * different ranges, so they cannot take each other's slot before the
+ * hit is written.
+ */
+static unsigned intern(int field, char *str, int len)
+{
+	struct blog_string rec;
+	unsigned id;
+
+	if(!str) return 0;
+
+	id = field * FIELD_STRINGS + (hash_str(str, len) & (FIELD_STRINGS - 1));
+	if(strs[id].str && strs[id].len == len &&
+	   memcmp(strs[id].str, str, len) == 0)
+		return id + 1;
+
+	free(strs[id].str);
+	if(!(strs[id].str = malloc(len + 1))) return 0;
+	memcpy(strs[id].str, str, len);
+	strs[id].len = len;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.rec.type = BLOG_STRING;
+	rec.rec.len = sizeof(rec) + len;
+	rec.rec.stream = stream;
+	rec.id = id + 1;
+	blog_put(&rec, sizeof(rec));
+	blog_put(str, len);
+
+	return id + 1;
+}
+
+
+static void blog_hit(struct hit *h)
+{
+	struct blog_hit rec;
+	int i;
+
+	if(new_stream) {
+		struct blog_start start;
+
+		for(i = 0; i < BLOG_STRINGS; ++i) {
+			free(strs[i].str);
+			strs[i].str = NULL;
+		}
+
+		stream = getpid();
+		memset(&start, 0, sizeof(start));
+		start.rec.type = BLOG_START;
+		start.rec.len = sizeof(start);
+		start.rec.stream = stream;
+		memcpy(start.magic, BLOG_MAGIC, sizeof(start.magic));
+		start.version = BLOG_VERSION;
+		blog_put(&start, sizeof(start));
+
+		new_stream = 0;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.rec.type = BLOG_HIT;
+	rec.rec.flags = h->flags;
+	rec.rec.len = sizeof(rec);
+	rec.rec.stream = stream;
+	rec.time = h->time;
+	rec.addr = h->addr;
+	rec.status = h->status;
+	rec.length = h->length;
+	rec.sel = intern(SEL, h->str[SEL], h->len[SEL]);
+	rec.host = intern(HOST, h->str[HOST], h->len[HOST]);
+	rec.referer = intern(REFERER, h->str[REFERER], h->len[REFERER]);
+	rec.agent = intern(AGENT, h->str[AGENT], h->len[AGENT]);
+	blog_put(&rec, sizeof(rec));
+}
+
+
+static void reopen_log(void)
+{
+	if(log_fp) fclose(log_fp);
 
 	if((log_fp = fopen(log_name, "a")) == NULL)
 		syslog(LOG_ERR, "Reopen %s: %m", log_name);
 
+	new_stream = 1;
+
 	syslog(LOG_WARNING, "Log file reopened.");
 }
 
 
+void log_reopen(int sig)
+{
+	reopen_pending = 1;
+}
+
+
+// The date in common log format. Only redone when the second changes.
+static char *log_date(time_t t)
+{
+	static THREAD_LOCAL char date[32];
+	static THREAD_LOCAL time_t date_time;
+	struct tm tm;
+
+	if(t != date_time) {
+		date_time = t;
+		strftime(date, sizeof(date), "[%d/%b/%Y:%T %z]",
+				 localtime_r(&t, &tm));
+	}
+
+	return date;
+}
+
+
+// Formats h as a text log line, returns the length
+static int text_hit(struct hit *h, char *rec)
+{
+#ifdef LOG_HIT_DBG
+	static unsigned logcnt = 0;
+#endif
+	int n;
+
+	// The strings are limited, this is 600 + hostname chars max
+#ifdef LOG_HIT_DBG
+	n = snprintf(rec, MAX_REC, "%s - %u %s \"%s %.*s/%.*s\" %u %u",
+				 ntoa(h->addr), logcnt++, log_date(h->time),
+#else
+	n = snprintf(rec, MAX_REC, "%s - - %s \"%s %.*s/%.*s\" %u %u",
+				 ntoa(h->addr), log_date(h->time),
+#endif
+				 h->flags & BLOG_HEAD ? "HEAD" : "GET",
+				 h->len[HOST], h->str[HOST] ? h->str[HOST] : "",
+				 h->len[SEL], h->str[SEL], h->status, h->length);
+
+	if(combined_log && (h->flags & BLOG_HTTP) && n < MAX_REC)
+		n += snprintf(rec + n, MAX_REC - n, " \"%.*s\" \"%.*s\"",
+					  h->str[REFERER] ? h->len[REFERER] : 1,
+					  h->str[REFERER] ? h->str[REFERER] : "-",
+					  h->str[AGENT] ? h->len[AGENT] : 1,
+					  h->str[AGENT] ? h->str[AGENT] : "-");
+
+	if(n > MAX_REC - 2) n = MAX_REC - 2;
+	rec[n++] = '\n';
+	rec[n] = '\0';
+
+	return n;
+}
+
+
+#ifdef THREADS
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Async logging. Each event loop puts its hits in its own ring. Only
+ * the loop moves the head and only the writer thread moves the tail,
+ * so putting a hit takes no lock. The writer drains all the rings
+ * every log-flush-interval, or sooner if a loop has log-flush-size
+ * bytes waiting. Text lines are written straight from the rings with
+ * one writev. Binary hits go in the rings as a raw_hit and the writer
+ * interns the strings.
+ */
+struct ring {
+	char *buf;
+	unsigned long size;    // a power of 2
+	unsigned long head;    // bytes ever put
+	unsigned long tail;    // bytes ever written
+	unsigned long drain;   // writer only, head when we started writing
+	struct ring *next;
+};
+
+// The strings follow, in str order
+struct raw_hit {
+	unsigned short len;    // of the whole thing
+	short str_len[N_STRS]; // -1 for none
+	unsigned addr;
+	unsigned status;
+	unsigned length;
+	int flags;
+	time_t time;
+};
+
+static struct ring *rings;             // all of them, for the writer
+static THREAD_LOCAL struct ring *ring; // this loop's
+static struct iovec *log_iovs;         // two per ring
+static pthread_t writer;
+static int writer_running;
+static int writer_stop;
+static int kicked;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;
+
+
+// rec may not be aligned, so the raw_hit is copied in and out
+static int raw_hit(struct hit *h, char *rec)
+{
+	struct raw_hit raw;
+	char *p = rec + sizeof(struct raw_hit);
+	int i;
+
+	raw.addr = h->addr;
+	raw.status = h->status;
+	raw.length = h->length;
+	raw.flags = h->flags;
+	raw.time = h->time;
+	for(i = 0; i < N_STRS; ++i)
+		if(h->str[i]) {
+			raw.str_len[i] = h->len[i];
+			memcpy(p, h->str[i], h->len[i]);
+			p += h->len[i];
+		} else
+			raw.str_len[i] = -1;
+	raw.len = p - rec;
+
+	memcpy(rec, &raw, sizeof(raw));
+	return raw.len;
+}
+
+
+static void unraw_hit(char *rec, struct hit *h)
+{
+	struct raw_hit raw;
+	char *p = rec + sizeof(struct raw_hit);
+	int i;
+
+	memcpy(&raw, rec, sizeof(raw));
+	h->addr = raw.addr;
+	h->status = raw.status;
+	h->length = raw.length;
+	h->flags = raw.flags;
+	h->time = raw.time;
+	for(i = 0; i < N_STRS; ++i)
+		if(raw.str_len[i] >= 0) {
+			h->str[i] = p;
+			h->len[i] = raw.str_len[i];
+			p += h->len[i];
+		} else
+			h->str[i] = NULL;
+}
+
+
+static struct ring *new_ring(void)
+{
+	struct ring *r;
+	unsigned long size;
+
+	for(size = 16 * 1024; size < log_buffer_size; size <<= 1) ;
+
+	if(!(r = calloc(1, sizeof(struct ring))) || !(r->buf = malloc(size))) {
+		syslog(LOG_ERR, "log: out of memory");
+		free(r);
+		return NULL;
+	}
+	r->size = size;
+
+	pthread_mutex_lock(&writer_lock);
+	r->next = rings;
+	__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&writer_lock);
+
+	return r;
+}
+
+
+static void kick(void)
+{
+	pthread_mutex_lock(&writer_lock);
+	kicked = 1;
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+
+static void ring_put(char *rec, unsigned long len)
+{
+	unsigned long head, tail, off, n;
+
+	if(!ring && !(ring = new_ring())) return;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	while(ring->size - (head - tail) < len) {
+		if(log_full == LOG_DROP) {
+			++stats->log_drops;
+			if(!kicked) kick();
+			return;
+		}
+
+		// Wait for the writer to make room
+		pthread_mutex_lock(&writer_lock);
+		kicked = 1;
+		pthread_cond_signal(&writer_wake);
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(ring->size - (head - tail) < len)
+			pthread_cond_wait(&ring_space, &writer_lock);
+		pthread_mutex_unlock(&writer_lock);
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	}
+
+	off = head & (ring->size - 1);
+	n = ring->size - off;
+	if(n > len) n = len;
+	memcpy(ring->buf + off, rec, n);
+	memcpy(ring->buf, rec + n, len - n);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+	if(head + len - tail >= log_flush_size && !kicked)
+		kick();
+}
+
+
+static void ring_get(struct ring *r, unsigned long pos, char *buf,
+					 unsigned long len)
+{
+	unsigned long off = pos & (r->size - 1);
+	unsigned long n = r->size - off;
+
+	if(n > len) n = len;
+	memcpy(buf, r->buf + off, n);
+	memcpy(buf + n, r->buf, len - n);
+}
+
+
+static void write_iovs(int fd, struct iovec *iov, int n)
+{
+	ssize_t len;
+
+	while(n > 0) {
+		if((len = writev(fd, iov, n)) < 0) {
+			if(errno == EINTR) continue;
+			syslog(LOG_ERR, "log write: %m");
+			return;
+		}
+
+		for( ; n > 0 && len >= iov->iov_len; ++iov, --n)
+			len -= iov->iov_len;
+		if(n > 0) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+}
+
+
+// Writes out everything the loops have put so far
+static void drain(void)
+{
+	struct ring *r;
+	unsigned long off, n, first, pos;
+	unsigned short len;
+	char rec[MAX_REC];
+	struct hit h;
+	int i = 0;
+
+	if(reopen_pending) {
+		reopen_pending = 0;
+		reopen_log();
+	}
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		r->drain = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if((n = r->drain - r->tail) == 0) continue;
+
+		if(binary_log) {
+			// the len is first
+			for(pos = r->tail; pos < r->drain; pos += len) {
+				ring_get(r, pos, (char *)&len, sizeof(len));
+				ring_get(r, pos, rec, len);
+				unraw_hit(rec, &h);
+				blog_hit(&h);
+			}
+			continue;
+		}
+
+		off = r->tail & (r->size - 1);
+		first = r->size - off;
+		if(first > n) first = n;
+		log_iovs[i].iov_base = r->buf + off;
+		log_iovs[i++].iov_len = first;
+		if(n > first) {
+			log_iovs[i].iov_base = r->buf;
+			log_iovs[i++].iov_len = n - first;
+		}
+	}
+
+	if(blog_len) {
+		log_iovs[i].iov_base = blog_buf;
+		log_iovs[i++].iov_len = blog_len;
+		blog_len = 0;
+	}
+
+	if(i && log_fp)
+		write_iovs(fileno(log_fp), log_iovs, i);
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		__atomic_store_n(&r->tail, r->drain, __ATOMIC_RELEASE);
+}
+
+
+static void *log_writer(void *arg)
+{
+	struct timespec ts;
+
+	while(1) {
+		pthread_mutex_lock(&writer_lock);
+		if(!kicked && !__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec  += log_flush_interval / 1000;
+			ts.tv_nsec += (log_flush_interval % 1000) * 1000000L;
+			if(ts.tv_nsec >= 1000000000L) {
+				++ts.tv_sec;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&writer_wake, &writer_lock, &ts);
+		}
+		kicked = 0;
+		pthread_mutex_unlock(&writer_lock);
+
+		drain();
+
+		// log_close is waiting on us, it may be a signal handler
+		if(__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		pthread_mutex_lock(&writer_lock);
+		pthread_cond_broadcast(&ring_space);
+		pthread_mutex_unlock(&writer_lock);
+	}
+}
+
+
+// Starts the async writer. Call in each worker before the loops start.
+void log_start(void)
+{
+	sigset_t set, old;
+
+	if(!log_async || !log_fp) return;
+
+	if(log_flush_interval < 1) log_flush_interval = 1;
+
+	// two per ring plus the binary buffer
+	if(!(log_iovs = calloc(threads * 2 + 1, sizeof(struct iovec)))) {
+		syslog(LOG_ERR, "log: out of memory, async logging off");
+		return;
+	}
+
+	// The signals are for the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if(pthread_create(&writer, NULL, log_writer, NULL))
+		syslog(LOG_ERR, "log: unable to create writer, async logging off");
+	else
+		writer_running = 1;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#else
+void log_start(void) {}
+#endif
+
+
 // We are root and outside the chroot jail
 int log_open(char *logname)
 {
@@ -69,120 +591,135 @@ int log_open(char *logname)
 }
 
 
-// Common log file format
-void log_hit(struct connection *conn, unsigned status)
+static void log_write(struct hit *h)
 {
-#ifdef LOG_HIT_DBG
-	static unsigned logcnt = 0;
-#endif
-	char common[80], *p;
-	time_t now;
-	struct tm *t;
+	char rec[MAX_REC], *out;
 	int n;
 
+#ifdef THREADS
+	if(writer_running) {
+		ring_put(rec, binary_log ? raw_hit(h, rec) : text_hit(h, rec));
+		return;
+	}
+
+	pthread_mutex_lock(&log_lock);
+#endif
+
+	if(reopen_pending) {
+		reopen_pending = 0;
+		reopen_log();
+	}
+
+	if(log_fp) {
+		if(binary_log) {
+			blog_hit(h);
+			out = blog_buf;
+			n = blog_len;
+			blog_len = 0;
+		} else {
+			out = rec;
+			n = text_hit(h, rec);
+		}
+
+		if(n > 0)
+			while(fwrite(out, n, 1, log_fp) != 1 && errno == EINTR) ;
+
+		fflush(log_fp);
+	}
+
+#ifdef THREADS
+	pthread_mutex_unlock(&log_lock);
+#endif
+}
+
+
+// The value of a header line, up to max chars. NULL if it has none.
+static char *header(char *line, int skip, char *what, int max, int *len)
+{
+	char *p;
+
+	if(!line) return NULL;
+
+	for(line += skip; isspace((int)*line); ++line) ;
+	if(!(p = strchr(line, '\r')) && !(p = strchr(line, '\n'))) {
+		syslog(LOG_DEBUG, "Bad %s '%s'", what, line);
+		return NULL;
+	}
+
+	*len = p - line;
+	if(*len > max) *len = max;
+	return line;
+}
+
+
+// Common log file format, or binary
+void log_hit(struct connection *conn, unsigned status)
+{
+	struct hit h;
+	char *sel;
+	int max;
+
 	if(!log_fp) return; // nowhere to write!
 
 	if(ignore_local &&
 	   ((conn->addr & 0xffff0000) == 0xc0a80000 ||
 		conn->addr == 0x7f000001)) return;
 
-	time(&now);
-	t = localtime(&now);
-
-	// Get some of the fixed length common stuff out of the way
-	strcpy(common, ntoa(conn->addr));
-	p = common + strlen(common);
-#ifdef LOG_HIT_DBG
-	sprintf(p, " - %u ", logcnt++);
-	p += strlen(p);
-	strftime(p, sizeof(common) - 30, "[%d/%b/%Y:%T %z] \"", t);
-#else
-	strftime(p, sizeof(common) - 30, " - - [%d/%b/%Y:%T %z] \"", t);
-#endif
-	strcat(p, conn->http == HTTP_HEAD ? "HEAD" : "GET");
+	memset(&h, 0, sizeof(h));
+	h.time = now ? now : time(NULL);
+	h.addr = conn->addr;
+	h.status = status;
+	h.length = conn->len;
+	if(conn->http == HTTP_HEAD) h.flags |= BLOG_HEAD;
 
 	if(conn->http) {
-		char *request;
+		h.flags |= BLOG_HTTP;
 
 		// SAM Save this?
-		request = conn->cmd;
-		request += 4;
-		while(isspace((int)*request)) ++request;
-		if(*request == '/') ++request;
-
-		// For gopher requests
-		if(*request && *(request + 1) == '/') request += 2;
+		sel = conn->cmd;
+		sel += 4;
+		while(isspace((int)*sel)) ++sel;
+		max = 200;
+
+		if(virtual_hosts && conn->host) {
+			h.str[HOST] = conn->host;
+			h.len[HOST] = strlen(conn->host);
+		}
 
 		if(combined_log) {
-			char *referer, *agent;
-
-			if((referer = conn->referer)) {
-				for(referer += 8; isspace((int)*referer); ++referer) ;
-				if((p = strchr(referer, '\r')) ||
-				   (p = strchr(referer, '\n')))
-					*p = '\0';
-				else {
-					syslog(LOG_DEBUG, "Bad referer '%s'", referer);
-					referer = "-";
-				}
-			} else
-				referer = "-";
-
-			if((agent = conn->user_agent)) {
-				for(agent += 12; isspace((int)*agent); ++agent) ;
-				if((p = strchr(agent, '\r')) ||
-				   (p = strchr(agent, '\n')))
-					*p = '\0';
-				else {
-					syslog(LOG_DEBUG, "Bad agent '%s'", agent);
-					agent = "-";
-				}
-			} else
-				agent = "-";
-
-			// This is 500 + hostname chars max
-			do
-				if(virtual_hosts && conn->host)
-					n = fprintf(log_fp,
-								"%s %s/%.200s\" %u %u \"%.100s\" \"%.100s\"\n",
-								common, conn->host, request, status, conn->len,
-								referer, agent);
-				else
-					n = fprintf(log_fp,
-								"%s /%.200s\" %u %u \"%.100s\" \"%.100s\"\n",
-								common, request, status, conn->len, referer, agent);
-			while(n < 0 && errno == EINTR);
-		} else {
-			// This is 600 + hostname chars max
-			do
-				if(virtual_hosts && conn->host)
-					n = fprintf(log_fp, "%s %s/%.200s\" %u %u\n",
-								common, conn->host, request, status, conn->len);
-				else
-					n = fprintf(log_fp, "%s /%.200s\" %u %u\n",
-								common, request, status, conn->len);
-			while(n < 0 && errno == EINTR);
+			h.str[REFERER] = header(conn->referer, 8, "referer", 100,
+									&h.len[REFERER]);
+			h.str[AGENT] = header(conn->user_agent, 12, "agent", 100,
+								  &h.len[AGENT]);
 		}
 	} else {
-		char *name = conn->cmd ? conn->cmd : "[Empty]";
+		sel = conn->cmd ? conn->cmd : "[Empty]";
+		max = 300;
+	}
 
-		if(*name == '/') ++name;
-		if(*name && *(name + 1) == '/') name += 2;
+	if(*sel == '/') ++sel;
+	// For gopher requests
+	if(*sel && *(sel + 1) == '/') sel += 2;
 
-		// This is 400 chars max
-		do
-			n = fprintf(log_fp, "%s /%.300s\" %u %u\n",
-						common, name, status, conn->len);
-		while(n < 0 && errno == EINTR);
-	}
+	h.str[SEL] = sel;
+	if((h.len[SEL] = strlen(sel)) > max) h.len[SEL] = max;
 
-	// every path
-	fflush(log_fp);
+	log_write(&h);
 }
 
 
 void log_close()
 {
+#ifdef THREADS
+	if(writer_running) {
+		// No lock, we may have interrupted a holder of it
+		__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&writer_wake);
+		pthread_join(writer, NULL);
+		writer_running = 0;
+	}
+#endif
+
 	if(log_fp) {
 		(void)fclose(log_fp);
 		log_fp = NULL;
@@ -0,0 +1,228 @@
+/*
+ * logcat.c - turn GoFish binary logs into common or combined log format
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "gofish.h"
+
+
+// The strings of one writer
+struct stream {
+	unsigned stream;
+	char *str[BLOG_STRINGS + 1];
+	int len[BLOG_STRINGS + 1];
+	struct stream *next;
+};
+
+static struct stream *streams;
+static int combined;
+
+// The biggest record we can have, len is 16 bits
+static union {
+	struct blog_rec rec;
+	struct blog_start start;
+	struct blog_string string;
+	struct blog_hit hit;
+	char buf[0x10000];
+} r;
+
+
+static struct stream *find_stream(unsigned id)
+{
+	struct stream *s;
+
+	for(s = streams; s; s = s->next)
+		if(s->stream == id)
+			return s;
+
+	if(!(s = calloc(1, sizeof(struct stream)))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	s->stream = id;
+	s->next = streams;
+	streams = s;
+	return s;
+}
+
+
+static void forget(struct stream *s)
+{
+	int i;
+
+	for(i = 0; i <= BLOG_STRINGS; ++i) {
+		free(s->str[i]);
+		s->str[i] = NULL;
+	}
+}
+
+
+static void add_string(struct stream *s)
+{
+	unsigned id = r.string.id;
+	int len = r.rec.len - sizeof(struct blog_string);
+
+	if(id == 0 || id > BLOG_STRINGS || len < 0) return;
+
+	free(s->str[id]);
+	if(!(s->str[id] = malloc(len + 1))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(s->str[id], r.buf + sizeof(struct blog_string), len);
+	s->len[id] = len;
+}
+
+
+// Prints the string for id, or def if there is none
+static void put_string(struct stream *s, unsigned id, char *def)
+{
+	if(id > 0 && id <= BLOG_STRINGS && s->str[id])
+		fwrite(s->str[id], s->len[id], 1, stdout);
+	else
+		fputs(def, stdout);
+}
+
+
+// Same as log_hit in the server
+static void put_hit(struct stream *s)
+{
+	static char date[32];
+	static time_t date_time = -1;
+	struct blog_hit *h = &r.hit;
+	time_t t = h->time;
+	struct tm tm;
+
+	if(t != date_time) {
+		date_time = t;
+		strftime(date, sizeof(date), "[%d/%b/%Y:%T %z]",
+				 localtime_r(&t, &tm));
+	}
+
+	printf("%u.%u.%u.%u - - %s \"%s ",
+		   (h->addr >> 24) & 0xff, (h->addr >> 16) & 0xff,
+		   (h->addr >>  8) & 0xff, h->addr & 0xff,
+		   date, (r.rec.flags & BLOG_HEAD) ? "HEAD" : "GET");
+	put_string(s, h->host, "");
+	putchar('/');
+	put_string(s, h->sel, "");
+	printf("\" %u %u", h->status, h->length);
+
+	if(combined && (r.rec.flags & BLOG_HTTP)) {
+		fputs(" \"", stdout);
+		put_string(s, h->referer, "-");
+		fputs("\" \"", stdout);
+		put_string(s, h->agent, "-");
+		putchar('"');
+	}
+
+	putchar('\n');
+}
+
+
+static int logcat(FILE *fp, char *fname)
+{
+	int first = 1, n;
+
+	while((n = fread(&r.rec, 1, sizeof(r.rec), fp)) == sizeof(r.rec)) {
+		if(r.rec.len < sizeof(r.rec)) {
+			fprintf(stderr, "%s: bad record\n", fname);
+			return 1;
+		}
+
+		n = r.rec.len - sizeof(r.rec);
+		if(fread(r.buf + sizeof(r.rec), 1, n, fp) != n) {
+			fprintf(stderr, "%s: truncated\n", fname);
+			return 1;
+		}
+
+		if(first) {
+			if(r.rec.type != BLOG_START || r.rec.len < sizeof(r.start) ||
+			   memcmp(r.start.magic, BLOG_MAGIC, sizeof(r.start.magic))) {
+				fprintf(stderr, "%s: not a GoFish binary log\n", fname);
+				return 1;
+			}
+			first = 0;
+		}
+
+		switch(r.rec.type) {
+		case BLOG_START:
+			if(r.start.version > BLOG_VERSION) {
+				fprintf(stderr, "%s: version %u not supported\n",
+						fname, r.start.version);
+				return 1;
+			}
+			forget(find_stream(r.rec.stream));
+			break;
+		case BLOG_STRING:
+			if(r.rec.len >= sizeof(r.string))
+				add_string(find_stream(r.rec.stream));
+			break;
+		case BLOG_HIT:
+			if(r.rec.len >= sizeof(r.hit))
+				put_hit(find_stream(r.rec.stream));
+			break;
+		default:
+			// a newer writer, skip it
+			break;
+		}
+	}
+
+	if(n > 0) {
+		fprintf(stderr, "%s: truncated\n", fname);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	int c, rc = 0;
+
+	while((c = getopt(argc, argv, "c")) != -1)
+		switch(c) {
+		case 'c': combined = 1; break;
+		default:
+			printf("usage: %s [-c] [logfile ...]\n", *argv);
+			exit(1);
+		}
+
+	if(optind == argc)
+		return logcat(stdin, "stdin");
+
+	for( ; optind < argc; ++optind) {
+		if(!(fp = fopen(argv[optind], "r"))) {
+			perror(argv[optind]);
+			rc = 1;
+			continue;
+		}
+		rc |= logcat(fp, argv[optind]);
+		fclose(fp);
+	}
+
+	return rc;
+}
@@ -0,0 +1,667 @@
+/*
+ * menu.c - in memory menus for the gofish gopher daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Menus are the .cache files. They are read into memory once and,
+ * with preprocess-cache, get the host and port filled in on the
+ * way. A menu is found by the (dev, ino) of its .cache and is good
+ * as long as the mtime and size match.
+ *
+ * Like the mmap cache, this is a fixed pool. Menus being sent are
+ * pinned with a reference count, the rest sit on an lru. If every
+ * entry is pinned we build a menu that is freed after sending.
+ *
+ * The http gateway hangs the page it renders for a menu off the
+ * entry, so it goes when the menu does. So does the index that
+ * menu_type uses to find the type of a file in the directory.
+ *
+ * If mkcache left a good .cache.idx next to the .cache, the menu is
+ * mapped from that instead: the menu comes already filled in and
+ * the selectors sorted, so there is nothing to parse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "gofish.h"
+
+
+struct menu {
+	char *data;
+	int len;
+	char *map;               // the .cache.idx if data is in it
+	size_t map_len;
+	struct idx_sel *sels;
+	int n_sels;
+	char *html;              // rendered page, url follows it
+	char *url;
+	int html_len;
+	int *index;              // menu_type, see build_index
+	unsigned index_mask;
+	int refs;
+	int hashed;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	struct menu *h_next;
+	struct menu *lru_next, *lru_prev;
+};
+
+static struct menu *menus;
+static struct menu **hash;
+static unsigned hash_mask;
+static struct menu lru; // list head, lru.lru_next is the oldest
+
+#ifdef THREADS
+static pthread_mutex_t menu_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MENU_LOCK()		pthread_mutex_lock(&menu_lock)
+#define MENU_UNLOCK()	pthread_mutex_unlock(&menu_lock)
+#else
+#define MENU_LOCK()
+#define MENU_UNLOCK()
+#endif
+
+
+static inline unsigned hash_key(dev_t dev, ino_t ino)
+{
+	unsigned long long h = ((unsigned long long)dev << 32) ^ ino;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned)(h >> 32) & hash_mask;
+}
+
+
+static void lru_del(struct menu *m)
+{
+	m->lru_prev->lru_next = m->lru_next;
+	m->lru_next->lru_prev = m->lru_prev;
+}
+
+
+static void lru_add(struct menu *m)
+{
+	m->lru_prev = lru.lru_prev;
+	m->lru_next = &lru;
+	lru.lru_prev->lru_next = m;
+	lru.lru_prev = m;
+}
+
+
+static void hash_del(struct menu *m)
+{
+	struct menu **p;
+
+	for(p = &hash[hash_key(m->dev, m->ino)]; *p; p = &(*p)->h_next)
+		if(*p == m) {
+			*p = m->h_next;
+			break;
+		}
+	m->h_next = NULL;
+	m->hashed = 0;
+}
+
+
+static void menu_free(struct menu *m)
+{
+	if(m->map)
+		munmap(m->map, m->map_len);
+	else
+		free(m->data);
+	free(m->html);
+	free(m->index);
+	m->data = m->html = m->url = m->map = NULL;
+	m->index = NULL;
+	m->sels = NULL;
+}
+
+
+static struct menu *find(dev_t dev, ino_t ino)
+{
+	struct menu *m;
+
+	for(m = hash[hash_key(dev, ino)]; m; m = m->h_next)
+		if(m->ino == ino && m->dev == dev)
+			return m;
+
+	return NULL;
+}
+
+
+void menu_init(void)
+{
+	unsigned size;
+	int i;
+
+	if(menu_cache_size < 1) menu_cache_size = 1;
+
+	for(size = 64; size < menu_cache_size * 2; size <<= 1) ;
+	hash_mask = size - 1;
+
+	menus = calloc(menu_cache_size, sizeof(struct menu));
+	hash = calloc(size, sizeof(struct menu *));
+	if(menus == NULL || hash == NULL) {
+		syslog(LOG_ERR, "menu_init: out of memory");
+		exit(1);
+	}
+
+	lru.lru_next = lru.lru_prev = &lru;
+	for(i = 0; i < menu_cache_size; ++i)
+		lru_add(&menus[i]);
+}
+
+
+/* Adds the host and port to the lines that are missing them, the way
+ * a .cache written by mkcache -p would have them.
+ */
+static char *preprocess(char *raw, int n, int *len)
+{
+	char portstr[12], *out, *o, *line, *nl, *p, *end = raw + n;
+	int hlen = strlen(hostname), plen, lines = 1;
+
+	plen = sprintf(portstr, "\t%d", port);
+
+	for(p = raw; (p = memchr(p, '\n', end - p)); ++p)
+		++lines;
+
+	// Worst case every line needs both
+	if(!(out = malloc(n + lines * (hlen + plen + 2)))) return NULL;
+
+	for(o = out, line = raw; line < end; line = nl + 1) {
+		int fields = 1;
+
+		if(!(nl = memchr(line, '\n', end - line))) nl = end;
+
+		for(p = line; p < nl && *p != '\r'; ++p)
+			if(*p == '\t') ++fields;
+
+		memcpy(o, line, p - line);
+		o += p - line;
+
+		switch(fields) {
+		case 2: /* host missing */
+			*o++ = '\t';
+			memcpy(o, hostname, hlen);
+			o += hlen;
+			/* fallthru */
+		case 3: /* port missing */
+			memcpy(o, portstr, plen);
+			o += plen;
+		}
+
+		*o++ = '\n';
+	}
+
+	*len = o - out;
+	return out;
+}
+
+
+// Reads the .cache behind fd. Returns the menu text or NULL.
+static char *read_menu(int fd, struct stat *sbuf, int *len)
+{
+	char *raw, *data;
+	int n;
+
+	if(!(raw = malloc(sbuf->st_size + 1))) return NULL;
+
+	if((n = READ(fd, raw, sbuf->st_size)) < 0) {
+		free(raw);
+		return NULL;
+	}
+
+	if(!process_cache) {
+		*len = n;
+		return raw;
+	}
+
+	data = preprocess(raw, n, len);
+	free(raw);
+	return data;
+}
+
+
+// Does everything in the index point inside it?
+static int idx_ok(struct idx_header *h, char *map, size_t size)
+{
+	struct idx_sel *sel;
+	unsigned i;
+
+	if((unsigned long long)h->menu_off + h->menu_len > size ||
+	   h->sel_off % sizeof(unsigned) ||
+	   h->sel_off + (unsigned long long)h->n_sels * sizeof(struct idx_sel) > size)
+		return 0;
+
+	sel = (struct idx_sel *)(map + h->sel_off);
+	for(i = 0; i < h->n_sels; ++i, ++sel)
+		if((unsigned long long)sel->off + sel->len > size)
+			return 0;
+
+	return 1;
+}
+
+
+/* Maps the .cache.idx that goes with the .cache at path into m, if
+ * it was built from the .cache sbuf describes. Returns -1 if we have
+ * to read the .cache.
+ */
+static int map_idx(char *path, struct stat *sbuf, struct menu *m)
+{
+	char idx[MAX_LINE + 20], *map;
+	struct idx_header *h;
+	struct stat ibuf;
+	int fd;
+
+	if(strlen(path) + 5 > sizeof(idx)) return -1;
+	sprintf(idx, "%s.idx", path);
+
+	if((fd = open(idx, O_RDONLY)) < 0) return -1;
+	if(fstat(fd, &ibuf) || ibuf.st_size < sizeof(struct idx_header)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, ibuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+
+	h = (struct idx_header *)map;
+	if(memcmp(h->magic, IDX_MAGIC, sizeof(h->magic)) ||
+	   h->version != IDX_VERSION ||
+	   h->mtime != sbuf->st_mtime || h->size != sbuf->st_size ||
+	   h->port != port || strncmp(h->host, hostname, MAX_HOSTNAME) ||
+	   !idx_ok(h, map, ibuf.st_size)) {
+		munmap(map, ibuf.st_size);
+		return -1;
+	}
+
+	m->map     = map;
+	m->map_len = ibuf.st_size;
+	m->data    = map + h->menu_off;
+	m->len     = h->menu_len;
+	m->sels    = (struct idx_sel *)(map + h->sel_off);
+	m->n_sels  = h->n_sels;
+	return 0;
+}
+
+
+static struct menu *pin(struct menu *m)
+{
+	if(m->refs++ == 0)
+		lru_del(m);
+	return m;
+}
+
+
+static void unpin(struct menu *m)
+{
+	MENU_LOCK();
+	if(--m->refs == 0) {
+		if(m->hashed)
+			lru_add(m);
+		else if(m >= menus && m < menus + menu_cache_size) {
+			// went stale while we were sending it
+			menu_free(m);
+			lru_add(m);
+		} else {
+			menu_free(m);
+			free(m);
+		}
+	}
+	MENU_UNLOCK();
+}
+
+
+static unsigned char *hit(struct connection *conn, struct menu *m)
+{
+	conn->menu = m;
+	conn->len = m->len;
+	return (unsigned char *)m->data;
+}
+
+
+/* For the selector cache: the menu for a .cache we already know the
+ * stat of, without any syscalls. NULL if we do not have it.
+ */
+unsigned char *menu_find(struct connection *conn, struct selector *sel)
+{
+	struct menu *m;
+	unsigned char *data = NULL;
+
+	MENU_LOCK();
+	if((m = find(sel->dev, sel->ino)) &&
+	   m->mtime == sel->mtime && m->size == sel->size)
+		data = hit(conn, pin(m));
+	MENU_UNLOCK();
+
+	return data;
+}
+
+
+/* The menu for the .cache at path, open on fd, pinned. sbuf is its
+ * stat. NULL if it could not be read.
+ */
+static struct menu *get(char *path, int fd, struct stat *sbuf)
+{
+	struct menu *m, body;
+
+	MENU_LOCK();
+	if((m = find(sbuf->st_dev, sbuf->st_ino))) {
+		if(m->mtime == sbuf->st_mtime && m->size == sbuf->st_size) {
+			pin(m);
+			MENU_UNLOCK();
+			return m;
+		}
+
+		// Stale. If it is still being sent, the last
+		// menu_release frees it.
+		hash_del(m);
+		if(m->refs == 0)
+			menu_free(m);
+	}
+	MENU_UNLOCK();
+
+	// Build it without the lock, it reads the file
+	memset(&body, 0, sizeof(body));
+	if(map_idx(path, sbuf, &body) &&
+	   !(body.data = read_menu(fd, sbuf, &body.len))) {
+		syslog(LOG_WARNING, "menu: out of memory");
+		return NULL;
+	}
+
+	MENU_LOCK();
+	if((m = lru.lru_next) == &lru) {
+		// All in use, this one goes when it is sent
+		MENU_UNLOCK();
+		if(!(m = calloc(1, sizeof(struct menu)))) {
+			menu_free(&body);
+			return NULL;
+		}
+		*m = body;
+		m->refs = 1;
+		return m;
+	}
+
+	if(m->hashed) hash_del(m);
+	menu_free(m);
+
+	lru_del(m);
+	m->data    = body.data;
+	m->len     = body.len;
+	m->map     = body.map;
+	m->map_len = body.map_len;
+	m->sels    = body.sels;
+	m->n_sels  = body.n_sels;
+	m->refs    = 1;
+	m->dev   = sbuf->st_dev;
+	m->ino   = sbuf->st_ino;
+	m->mtime = sbuf->st_mtime;
+	m->size  = sbuf->st_size;
+	m->h_next = hash[hash_key(m->dev, m->ino)];
+	hash[hash_key(m->dev, m->ino)] = m;
+	m->hashed = 1;
+	MENU_UNLOCK();
+
+	return m;
+}
+
+
+/* The menu for the .cache open on fd. sbuf is its stat. Sets
+ * conn->len and returns the menu text, or NULL if it could not be
+ * read. The caller still closes fd.
+ */
+unsigned char *menu_get(struct connection *conn, char *path, int fd,
+						struct stat *sbuf)
+{
+	struct menu *m;
+
+	if(!(m = get(path, fd, sbuf))) return NULL;
+	return hit(conn, m);
+}
+
+
+void menu_release(struct connection *conn)
+{
+	struct menu *m = conn->menu;
+
+	conn->menu = NULL;
+	conn->buf = NULL;
+	unpin(m);
+}
+
+
+/* Finds the selector in a menu line: past the tab and the type
+ * prefix, up to the next tab. Returns its length or -1.
+ */
+static int line_selector(char *line, char *end, char **sel)
+{
+	char *p;
+
+	if(!(p = memchr(line, '\t', end - line)) || end - p < 3)
+		return -1;
+	*sel = p += 3;
+	while(p < end && *p != '\t' && *p != '\r') ++p;
+	return p - *sel;
+}
+
+
+// FNV-1a
+static unsigned hash_sel(char *sel, int len)
+{
+	unsigned h = 2166136261U;
+
+	while(len-- > 0) {
+		h ^= (unsigned char)*sel++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+// Is sel the selector of the line at index offset o?
+static int same(struct menu *m, int o, char *sel, int len)
+{
+	char *line = m->data + o - 1, *nl, *s, *end = m->data + m->len;
+
+	if(!(nl = memchr(line, '\n', end - line))) nl = end;
+	return line_selector(line, nl, &s) == len && memcmp(s, sel, len) == 0;
+}
+
+
+/* Hashes the lines of the menu on their selector, the first line
+ * wins. The index holds line offsets + 1, 0 is an empty slot.
+ */
+static int build_index(struct menu *m, int **index, unsigned *mask)
+{
+	char *line, *nl, *sel, *end = m->data + m->len;
+	unsigned size, h;
+	int lines = 0, len, *ix, *o;
+
+	for(line = m->data; line < end; line = nl + 1) {
+		if(!(nl = memchr(line, '\n', end - line))) nl = end;
+		++lines;
+	}
+
+	for(size = 16; size < lines * 2; size <<= 1) ;
+	if(!(ix = calloc(size, sizeof(int)))) return -1;
+
+	for(line = m->data; line < end; line = nl + 1) {
+		if(!(nl = memchr(line, '\n', end - line))) nl = end;
+		if((len = line_selector(line, nl, &sel)) < 0) continue;
+
+		for(h = hash_sel(sel, len); *(o = &ix[h & (size - 1)]); ++h)
+			if(same(m, *o, sel, len))
+				break;
+		if(*o == 0) *o = line - m->data + 1;
+	}
+
+	*index = ix;
+	*mask = size - 1;
+	return 0;
+}
+
+
+// Binary search of the sorted selectors from the .cache.idx
+static int idx_lookup(struct menu *m, char *name, int len)
+{
+	struct idx_sel *sel;
+	int lo = 0, hi = m->n_sels - 1, mid, n;
+
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		sel = &m->sels[mid];
+		n = memcmp(m->map + sel->off, name, sel->len < len ? sel->len : len);
+		if(n == 0) n = sel->len - len;
+		if(n == 0)
+			return sel->type;
+		if(n < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return 0;
+}
+
+
+static int lookup(struct menu *m, char *name)
+{
+	int len = strlen(name), *o;
+	unsigned h;
+
+	if(m->sels) return idx_lookup(m, name, len);
+
+	for(h = hash_sel(name, len); *(o = &m->index[h & m->index_mask]); ++h)
+		if(same(m, *o, name, len))
+			return m->data[*o - 1];
+
+	return 0;
+}
+
+
+/* The type the menu in cache gives name, going through an index of
+ * the menu built the first time it is asked. 0 if name is not in the
+ * menu, -1 if there is no menu.
+ */
+int menu_type(char *cache, char *name)
+{
+	struct stat sbuf;
+	struct menu *m;
+	int fd, type, *index = NULL;
+	unsigned mask = 0;
+
+	if(stat(cache, &sbuf)) return -1;
+
+	MENU_LOCK();
+	if((m = find(sbuf.st_dev, sbuf.st_ino)) && (m->index || m->sels) &&
+	   m->mtime == sbuf.st_mtime && m->size == sbuf.st_size) {
+		if(m->refs == 0) {
+			lru_del(m);
+			lru_add(m);
+		}
+		type = lookup(m, name);
+		MENU_UNLOCK();
+		return type;
+	}
+	MENU_UNLOCK();
+
+	if((fd = open(cache, O_RDONLY)) < 0) return -1;
+	if(fstat(fd, &sbuf) || !(m = get(cache, fd, &sbuf))) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// The menu is pinned, so we can build without the lock
+	if(!m->index && !m->sels && build_index(m, &index, &mask)) {
+		unpin(m);
+		return -1;
+	}
+
+	MENU_LOCK();
+	if(m->index == NULL) {
+		m->index = index;
+		m->index_mask = mask;
+	} else
+		free(index);
+	type = lookup(m, name);
+	MENU_UNLOCK();
+
+	unpin(m);
+
+	return type;
+}
+
+
+/* The page rendered for conn's menu, if it was rendered for this
+ * url. Sets conn->buf and conn->len, the menu stays pinned.
+ */
+unsigned char *menu_html(struct connection *conn, char *url)
+{
+	struct menu *m = conn->menu;
+	unsigned char *html = NULL;
+
+	MENU_LOCK();
+	if(m->html && strcmp(m->url, url) == 0) {
+		html = conn->buf = (unsigned char *)m->html;
+		conn->len = m->html_len;
+	}
+	MENU_UNLOCK();
+
+	return html;
+}
+
+
+/* Keeps html, a page rendered for conn's menu with url after the
+ * page, and sends it out of conn->buf. If the menu already has a
+ * page we cannot keep it, the page is sent once and freed.
+ */
+unsigned char *menu_html_set(struct connection *conn, char *html, int len)
+{
+	struct menu *m = conn->menu;
+
+	MENU_LOCK();
+	if(m->html == NULL && m->hashed) {
+		m->html = html;
+		m->url = html + len;
+		m->html_len = len;
+		MENU_UNLOCK();
+	} else {
+		MENU_UNLOCK();
+		menu_release(conn);
+		if(!(m = calloc(1, sizeof(struct menu)))) {
+			free(html);
+			return NULL;
+		}
+		m->html = html;
+		m->refs = 1;
+		conn->menu = m;
+	}
+
+	conn->buf = (unsigned char *)html;
+	conn->len = len;
+	return conn->buf;
+}
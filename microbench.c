@@ -0,0 +1,575 @@
+/*
+ * microbench.c - microbenchmarks for the gofish request hot path
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Calls the hot path functions directly, no sockets, in a tree made
+ * by gofish-corpus (see make bench). After a warm up, the benchmarks
+ * take turns for RUNS rounds, so a noisy moment on the machine hits
+ * them all rather than one, and the median run counts. Reports ns/op
+ * and, with glibc, allocations/op.
+ *
+ * The results are compared with the -b baseline file: a benchmark
+ * more than -t percent slower, or that allocates more, fails. The
+ * baseline is only written with -w.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "gofish.h"
+
+#define RUNS		15
+#define RUN_NSECS	30000000LL	// 30ms
+
+struct bench {
+	char *name;
+	void (*fn)(void);
+	long long iters;
+	long long t[RUNS];
+	double ns, allocs;
+};
+
+// needed by http.c and log.c
+int verbose;
+THREAD_LOCAL struct stats *stats;
+
+static struct connection bconn;
+static char path[MAX_LINE + 10];
+static unsigned long long n_allocs;
+
+
+#ifdef __GLIBC__
+// Count the allocations. glibc lets us interpose these.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	++n_allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	++n_allocs;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	++n_allocs;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+
+static long long nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static int must_open(char *fname)
+{
+	int fd;
+
+	if((fd = open(fname, O_RDONLY)) < 0) {
+		perror(fname);
+		exit(1);
+	}
+	return fd;
+}
+
+
+static void must_close(int fd)
+{
+	if(fd < 0 || close(fd)) {
+		perror("smart_open");
+		exit(1);
+	}
+}
+
+
+/* The benchmarks. Paths are in the gofish-corpus tree. */
+
+static void b_smart_open_typed(void)
+{
+	char type;
+
+	must_close(smart_open("0/d0/f0000.txt", &type, path));
+}
+
+
+static void b_smart_open_untyped(void)
+{
+	char type;
+
+	must_close(smart_open("d0/f0003.gif", &type, path));
+}
+
+
+static void b_smart_open_huge(void)
+{
+	char type;
+
+	must_close(smart_open("huge/f0502.zip", &type, path));
+}
+
+
+static void b_open_selector(void)
+{
+	static struct connection conn;
+	char type;
+	int fd;
+
+	if(open_selector(&conn, "0/d1/f0001.html", &type, &fd, 0)) {
+		perror("open_selector");
+		exit(1);
+	}
+	if(fd >= 0)
+		close(fd);
+	else
+		mmap_release(&conn);
+}
+
+
+static void b_mime_find(void)
+{
+	mime_find("d0/f0001.html");
+	mime_find("d0/f0006.gz");
+	mime_find("README");
+}
+
+
+static int mmap_fd;
+
+static void b_mmap_get(void)
+{
+	if(!(bconn.buf = mmap_get(&bconn, mmap_fd))) {
+		perror("mmap_get");
+		exit(1);
+	}
+	mmap_release(&bconn);
+}
+
+
+// What the server calls open_cache: open a .cache and get its menu
+static void b_menu_get(void)
+{
+	static struct connection conn;
+	struct stat sbuf;
+	int fd = must_open("huge/.cache");
+
+	fstat(fd, &sbuf);
+	if(!(conn.buf = menu_get(&conn, "huge/.cache", fd, &sbuf))) {
+		perror("menu_get");
+		exit(1);
+	}
+	close(fd);
+	menu_release(&conn);
+}
+
+
+static char *dir_menu;
+static int dir_menu_len;
+
+// One page for d0's menu, without the cache around it
+static void b_http_dir_line(void)
+{
+	struct page pg;
+	char *s = dir_menu, *end = dir_menu + dir_menu_len, *p;
+
+	pg.size = dir_menu_len * 4 + 1024;
+	pg.len = pg.oom = 0;
+	pg.buf = malloc(pg.size);
+
+	for( ; s < end; s = p + 1) {
+		if(!(p = memchr(s, '\n', end - s))) p = end;
+		if(p > s) http_dir_line(&pg, s, p - s);
+	}
+
+	free(pg.buf);
+}
+
+
+static struct connection dir_conn;
+
+static void b_http_directory(void)
+{
+	if(http_directory(&dir_conn, "1/huge")) {
+		perror("http_directory");
+		exit(1);
+	}
+}
+
+
+static void b_unquote(void)
+{
+	char str[80];
+
+	strcpy(str, "/0/some%20dir/file%2Bname%2C%20v2.txt");
+	unquote(str);
+}
+
+
+static void b_log_hit(void)
+{
+	log_hit(&bconn, 200);
+}
+
+
+static struct bench benches[] = {
+	{ "smart_open_typed",	b_smart_open_typed },
+	{ "smart_open_untyped",	b_smart_open_untyped },
+	{ "smart_open_huge",	b_smart_open_huge },
+	{ "open_selector",		b_open_selector },
+	{ "mime_find",			b_mime_find },
+	{ "mmap_get",			b_mmap_get },
+	{ "menu_get",			b_menu_get },
+	{ "http_dir_line",		b_http_dir_line },
+	{ "http_directory",		b_http_directory },
+	{ "unquote",			b_unquote },
+	{ "log_hit",			b_log_hit },
+};
+#define N_BENCHES	(sizeof(benches) / sizeof(struct bench))
+
+
+/* Not a benchmark. The selector and agent below hash to the same
+ * binary log slot, which once made the hit read back with the agent
+ * as its selector. Log the hit and read it back.
+ */
+static void check_blog(void)
+{
+	static union {
+		struct blog_rec rec;
+		struct blog_string string;
+		struct blog_hit hit;
+		char buf[1024];
+	} r;
+	static char *str[BLOG_STRINGS + 1];
+	struct connection conn;
+	char *fname = "check.blog";
+	FILE *fp;
+	int len, ok = 0;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.addr = 0x0a000001;
+	conn.http = HTTP_GET;
+	conn.cmd = "GET /0/z3162 HTTP/1.0";
+	conn.user_agent = "User-Agent: bench-agent\r\n";
+
+	unlink(fname);
+	binary_log = combined_log = 1;
+	if(!log_open(fname)) {
+		perror(fname);
+		exit(1);
+	}
+	log_hit(&conn, 404);
+	log_close();
+	binary_log = combined_log = 0;
+
+	if(!(fp = fopen(fname, "r"))) {
+		perror(fname);
+		exit(1);
+	}
+	while(fread(&r.rec, sizeof(r.rec), 1, fp) == 1) {
+		len = r.rec.len - sizeof(r.rec);
+		if(len < 0 || len > sizeof(r) - sizeof(r.rec) ||
+		   fread(r.buf + sizeof(r.rec), len, 1, fp) != (len > 0))
+			break;
+		if(r.rec.type == BLOG_STRING && r.string.id <= BLOG_STRINGS) {
+			len = r.rec.len - sizeof(struct blog_string);
+			free(str[r.string.id]);
+			str[r.string.id] = strndup(r.buf + sizeof(struct blog_string), len);
+		} else if(r.rec.type == BLOG_HIT)
+			ok = str[r.hit.sel] && str[r.hit.agent] &&
+				strcmp(str[r.hit.sel], "z3162 HTTP/1.0") == 0 &&
+				strcmp(str[r.hit.agent], "bench-agent") == 0;
+	}
+	fclose(fp);
+	unlink(fname);
+
+	if(!ok) {
+		printf("Binary log hit did not read back\n");
+		exit(1);
+	}
+}
+
+
+static void setup(char *tree)
+{
+	struct stat sbuf;
+	int fd;
+
+	// The defaults, as gofish-corpus used
+	read_config("/dev/null");
+	free(root_dir);
+	root_dir = must_strdup(tree);
+	is_gopher = 1;
+	ignore_local = 0;
+
+	if(!(stats = calloc(1, sizeof(struct stats)))) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	mime_init();
+	http_init();
+	mmap_init();
+	sel_init();
+	menu_init();
+
+	if(chdir(tree)) {
+		perror(tree);
+		exit(1);
+	}
+
+	check_blog();
+
+	if(!log_open("/dev/null")) {
+		perror("/dev/null");
+		exit(1);
+	}
+	now = time(NULL);
+
+	bconn.addr = 0x0a000001;
+	bconn.cmd = "0/d0/f0000.txt";
+
+	mmap_fd = must_open("d0/f0000.txt");
+	fstat(mmap_fd, &sbuf);
+	bconn.len = sbuf.st_size;
+
+	fd = must_open("d0/.cache");
+	fstat(fd, &sbuf);
+	dir_menu_len = sbuf.st_size;
+	if(!(dir_menu = malloc(dir_menu_len)) ||
+	   read(fd, dir_menu, dir_menu_len) != dir_menu_len) {
+		perror("d0/.cache");
+		exit(1);
+	}
+	close(fd);
+
+	fd = must_open("huge/.cache");
+	fstat(fd, &sbuf);
+	if(!(dir_conn.buf = menu_get(&dir_conn, "huge/.cache", fd, &sbuf))) {
+		perror("huge/.cache");
+		exit(1);
+	}
+	close(fd);
+}
+
+
+// Finds how many iterations take RUN_NSECS. This is also the warm up.
+static void calibrate(struct bench *b)
+{
+	long long start, iters = 1, i, t;
+
+	while(1) {
+		start = nsecs();
+		for(i = 0; i < iters; ++i) b->fn();
+		if((t = nsecs() - start) >= RUN_NSECS / 10) break;
+		iters *= 10;
+	}
+	b->iters = iters * RUN_NSECS / (t ? t : 1) + 1;
+}
+
+
+static void run(struct bench *b, int r)
+{
+	unsigned long long allocs = n_allocs;
+	long long start, i;
+
+	start = nsecs();
+	for(i = 0; i < b->iters; ++i) b->fn();
+	b->t[r] = nsecs() - start;
+
+	if(r == 0) b->allocs = (double)(n_allocs - allocs) / b->iters;
+}
+
+
+static int ll_compare(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static void median(struct bench *b)
+{
+	qsort(b->t, RUNS, sizeof(long long), ll_compare);
+	b->ns = (double)b->t[RUNS / 2] / b->iters;
+}
+
+
+static struct bench *find_bench(char *name)
+{
+	int i;
+
+	for(i = 0; i < N_BENCHES; ++i)
+		if(strcmp(benches[i].name, name) == 0)
+			return &benches[i];
+	return NULL;
+}
+
+
+/* Compares with the baseline. Returns the number of regressions, or
+ * -1 if there is no baseline.
+ */
+static int compare(char *fname, double threshold)
+{
+	char line[200], name[64];
+	double ns, allocs;
+	struct bench *b;
+	int bad = 0;
+	FILE *fp;
+
+	if(!(fp = fopen(fname, "r")))
+		return -1;
+
+	printf("\n%-20s %10s %10s %8s\n", "vs baseline", "ns/op", "was", "change");
+	while(fgets(line, sizeof(line), fp)) {
+		if(sscanf(line, "%63s %lf %lf", name, &ns, &allocs) != 3 ||
+		   !(b = find_bench(name)))
+			continue;
+
+		printf("%-20s %10.1f %10.1f %+7.1f%%", name, b->ns, ns,
+			   ns > 0 ? (b->ns - ns) * 100 / ns : 0.0);
+		if(b->ns > ns * (1 + threshold / 100)) {
+			printf("  SLOWER");
+			++bad;
+		}
+		if(b->allocs > allocs + 0.01) {
+			printf("  %.2f allocs, was %.2f", b->allocs, allocs);
+			++bad;
+		}
+		putchar('\n');
+	}
+
+	fclose(fp);
+	return bad;
+}
+
+
+static void save(char *fname)
+{
+	FILE *fp;
+	int i;
+
+	if(!(fp = fopen(fname, "w"))) {
+		perror(fname);
+		exit(1);
+	}
+	for(i = 0; i < N_BENCHES; ++i)
+		fprintf(fp, "%s %.1f %.2f\n",
+				benches[i].name, benches[i].ns, benches[i].allocs);
+	if(fclose(fp)) {
+		perror(fname);
+		exit(1);
+	}
+	printf("Wrote baseline %s\n", fname);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *baseline = NULL, full[PATH_MAX];
+	double threshold = 20;
+	int c, i, r, bad, write_baseline = 0;
+
+	while((c = getopt(argc, argv, "b:t:w")) != -1)
+		switch(c) {
+		case 'b': baseline = optarg; break;
+		case 't': threshold = strtod(optarg, 0); break;
+		case 'w': write_baseline = 1; break;
+		default:
+			printf("usage: %s [-w] [-b baseline] [-t percent] tree\n", *argv);
+			exit(1);
+		}
+	if(optind != argc - 1) {
+		printf("usage: %s [-w] [-b baseline] [-t percent] tree\n", *argv);
+		exit(1);
+	}
+
+	// We chdir into the tree
+	if(baseline && *baseline != '/') {
+		if(!getcwd(full, sizeof(full) - strlen(baseline) - 2)) {
+			perror("getcwd");
+			exit(1);
+		}
+		strcat(full, "/");
+		strcat(full, baseline);
+		baseline = full;
+	}
+
+	setup(argv[optind]);
+
+	for(i = 0; i < N_BENCHES; ++i)
+		calibrate(&benches[i]);
+	for(r = 0; r < RUNS; ++r)
+		for(i = 0; i < N_BENCHES; ++i)
+			run(&benches[i], r);
+
+	printf("%-20s %10s %10s\n", "", "ns/op", "allocs/op");
+	for(i = 0; i < N_BENCHES; ++i) {
+		median(&benches[i]);
+		printf("%-20s %10.1f", benches[i].name, benches[i].ns);
+#ifdef __GLIBC__
+		printf(" %10.2f\n", benches[i].allocs);
+#else
+		printf(" %10s\n", "-");
+#endif
+	}
+
+	if(!baseline)
+		return 0;
+
+	if(write_baseline) {
+		save(baseline);
+		return 0;
+	}
+
+	if((bad = compare(baseline, threshold)) < 0) {
+		printf("No baseline %s, make bench-baseline writes one\n", baseline);
+		return 0;
+	}
+
+	if(bad)
+		printf("%d regressions over %.0f%%\n", bad, threshold);
+	return bad ? 1 : 0;
+}
+
+
+/* Dummy functions for http.c */
+void close_connection(struct connection *conn, int status) {}
+int file_body(struct connection *conn, int fd, int iov) { return -1; }
+int gofish_metrics(struct connection *conn) { return -1; }
+#ifndef set_writeable
+void set_writeable(struct connection *conn) {}
+#endif
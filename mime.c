@@ -25,9 +25,14 @@
 #include "gofish.h"
 
 
+/*
+ * The extensions are hashed, ignoring case. The chains are indexes
+ * into mimes so that it can be realloced as it grows.
+ */
 struct mime {
 	char *ext;
 	char *mime;
+	int next; // next in the hash chain, -1 ends it
 };
 
 
@@ -35,7 +40,9 @@ static char *mime_file = "/etc/mime.types";
 static int mime_set = 0;
 
 static struct mime *mimes = NULL;
-static int n_mimes = 0;
+static int n_mimes = 0, max_mimes = 0;
+static int *hash = NULL;
+static unsigned hash_mask = 0;
 
 
 void set_mime_file(char *fname)
@@ -45,37 +52,87 @@ void set_mime_file(char *fname)
 }
 
 
+// FNV-1a of the lower case extension
+static unsigned hash_ext(char *ext)
+{
+	unsigned h = 2166136261U;
+
+	while(*ext) {
+		h ^= tolower((unsigned char)*ext++);
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+static struct mime *lookup(char *ext)
+{
+	int i;
+
+	if(hash == NULL) return NULL;
+
+	for(i = hash[hash_ext(ext) & hash_mask]; i >= 0; i = mimes[i].next)
+		if(strcasecmp(mimes[i].ext, ext) == 0)
+			return &mimes[i];
+
+	return NULL;
+}
+
+
 char *mime_find(char *fname)
 {
 	char *ext;
 	struct mime *m;
-	int i;
 
-	if((ext = strrchr(fname, '.'))) {
-		++ext;
+	if((ext = strrchr(fname, '.')) && (m = lookup(ext + 1)))
+		return m->mime;
 
-		for(m = mimes, i = 0; i < n_mimes; ++i, ++m)
-			if(strcmp(m->ext, ext) == 0)
-				return m->mime;
+	return NULL;
+}
+
+
+static void link_mime(int i)
+{
+	unsigned h = hash_ext(mimes[i].ext) & hash_mask;
+
+	mimes[i].next = hash[h];
+	hash[h] = i;
+}
+
+
+// Doubles the hash table, keeping it at least as big as mimes
+static void rehash(void)
+{
+	unsigned size = hash ? (hash_mask + 1) * 2 : 256;
+	int i;
+
+	free(hash);
+	if(!(hash = malloc(size * sizeof(int)))) {
+		printf("Out of memory\n");
+		exit(1);
 	}
+	hash_mask = size - 1;
+	memset(hash, 0xff, size * sizeof(int)); // all -1
 
-	return NULL;
+	for(i = 0; i < n_mimes; ++i)
+		link_mime(i);
 }
 
 
 static int add_mime(char *mime, char *ext)
 {
 	struct mime *m;
-	int i;
 
 	// See if extension already exists
-	for(m = mimes, i = 0; i < n_mimes; ++i, ++m)
-		if(strcmp(m->ext, ext) == 0)
-			return 1;
+	if(lookup(ext))
+		return 1;
 
-	if(!(mimes = realloc(mimes, (n_mimes + 1) * sizeof(struct mime)))) {
-		printf("Out of memory\n");
-		exit(1);
+	if(n_mimes == max_mimes) {
+		max_mimes = max_mimes ? max_mimes * 2 : 256;
+		if(!(mimes = realloc(mimes, max_mimes * sizeof(struct mime)))) {
+			printf("Out of memory\n");
+			exit(1);
+		}
 	}
 
 	m = mimes + n_mimes;
@@ -84,6 +141,11 @@ static int add_mime(char *mime, char *ext)
 	m->mime = must_strdup(mime);
 	m->ext  = must_strdup(ext);
 
+	if(hash == NULL || n_mimes > hash_mask + 1)
+		rehash();
+	else
+		link_mime(n_mimes - 1);
+
 	return 0;
 }
 
@@ -164,4 +226,8 @@ void mime_cleanup()
 	}
 
 	free(mimes);
+	free(hash);
+	mimes = NULL;
+	hash = NULL;
+	n_mimes = max_mimes = 0;
 }
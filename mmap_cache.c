@@ -67,28 +67,397 @@ int munmap(void *start, size_t length)
 }
 #endif
 
-unsigned bad_munmaps = 0;
+
+// Anonymous shared memory that survives a fork. Used for the stats.
+void *mmap_shared(int size)
+{
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) return NULL;
+	memset(mem, 0, size);
+	return mem;
+#else
+	// Not shared, each worker will only see its own
+	return calloc(1, size);
+#endif
+}
 
 
 #ifdef MMAP_CACHE
 
 int mmap_cache_size = MMAP_CACHE_SIZE;
 
-
+/*
+ * The cache is a fixed pool of mmap_cache_size entries. Mapped
+ * entries are found through a hash on (dev, ino). Unmapped entries
+ * sit on the free list. Mapped entries that are not in use sit on
+ * one of two queues, oldest at the head:
+ *
+ *   a1in - files asked for once
+ *   am   - files asked for again
+ *
+ * With the lru policy everything goes on am and it is a plain lru.
+ * With 2q, new files go on a1in and a1out remembers the (dev, ino)
+ * of the files pushed off a1in, without keeping them mapped. Only a
+ * file asked for again while in a1out goes on am. A crawler walking
+ * the whole tree then only churns a1in and the hot files on am stay.
+ *
+ * Entries in use stay where they are on their queue and eviction
+ * skips them. A hit moves an am entry to the tail, but leaves an
+ * a1in entry where it is: a1in is a fifo, so a file that is only
+ * asked for again while still on it is not promoted.
+ *
+ * The bytes mapped are also kept under a budget: mmap-cache-bytes,
+ * cut in half every second the system is under memory pressure and
+ * grown back afterwards. When we are over budget, entries are
+ * unmapped as soon as they are not in use.
+ */
 struct cache {
 	unsigned char *mapped;
 	int len;
-	time_t time;
 	time_t mtime;
+	dev_t dev;
 	ino_t ino;
 	int in_use;
+	int hashed;
+	struct cache *queue;            // a1in or am while mapped
+	struct cache *h_next;           // hash chain
+	struct cache *lru_next, *lru_prev;
+};
+
+// An a1out entry
+struct ghost {
+	dev_t dev;
+	ino_t ino;
+	int hashed;
+	struct ghost *h_next;
 };
 
 static struct cache *mmap_cache;
+static struct cache **hash;
+static unsigned hash_mask;
+static struct cache free_list, a1in, am; // list heads
+static int n_a1in, max_a1in;              // mapped entries on a1in
+
+static struct ghost *a1out;  // fifo, a1out_next is the oldest
+static struct ghost **ghost_hash;
+static int a1out_size, a1out_next;
+static unsigned long cache_bytes; // mapped, in use or not
+static unsigned long budget;      // max cache_bytes right now
+
+#ifdef __linux__
+static int psi_fd   = -1;
+static int proc_fd  = -1;
+static int statm_fd = -1;
+static time_t last_check;
+static int pressured;
+#endif
+
+#ifdef THREADS
+/* One lock for the whole cache. It is only held to look up, link and
+ * unlink entries, the mmap and munmap calls are made without it.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK()	pthread_mutex_lock(&cache_lock)
+#define CACHE_UNLOCK()	pthread_mutex_unlock(&cache_lock)
+#else
+#define CACHE_LOCK()
+#define CACHE_UNLOCK()
+#endif
+
+
+static inline unsigned hash_key(dev_t dev, ino_t ino)
+{
+	unsigned long long h = ((unsigned long long)dev << 32) ^ ino;
+
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned)(h >> 32) & hash_mask;
+}
+
+
+static void hash_add(struct cache *m)
+{
+	unsigned h = hash_key(m->dev, m->ino);
+
+	m->h_next = hash[h];
+	hash[h] = m;
+	m->hashed = 1;
+}
+
+
+static void hash_del(struct cache *m)
+{
+	struct cache **p;
+
+	for(p = &hash[hash_key(m->dev, m->ino)]; *p; p = &(*p)->h_next)
+		if(*p == m) {
+			*p = m->h_next;
+			break;
+		}
+	m->h_next = NULL;
+	m->hashed = 0;
+}
+
+
+// Overwrites the oldest ghost
+static void ghost_add(dev_t dev, ino_t ino)
+{
+	struct ghost *g = &a1out[a1out_next], **p;
+	unsigned h;
+
+	if(g->hashed)
+		for(p = &ghost_hash[hash_key(g->dev, g->ino)]; *p; p = &(*p)->h_next)
+			if(*p == g) {
+				*p = g->h_next;
+				break;
+			}
+
+	h = hash_key(dev, ino);
+	g->dev = dev;
+	g->ino = ino;
+	g->h_next = ghost_hash[h];
+	ghost_hash[h] = g;
+	g->hashed = 1;
+
+	a1out_next = (a1out_next + 1) % a1out_size;
+}
+
+
+// Returns 1 if we had a ghost for the file
+static int ghost_del(dev_t dev, ino_t ino)
+{
+	struct ghost **p, *g;
+
+	for(p = &ghost_hash[hash_key(dev, ino)]; (g = *p); p = &g->h_next)
+		if(g->ino == ino && g->dev == dev) {
+			*p = g->h_next;
+			g->hashed = 0;
+			return 1;
+		}
+
+	return 0;
+}
+
+
+static void lru_del(struct cache *m)
+{
+	m->lru_prev->lru_next = m->lru_next;
+	m->lru_next->lru_prev = m->lru_prev;
+	m->lru_next = m->lru_prev = NULL;
+}
+
+
+// Newest at the tail
+static void lru_add(struct cache *list, struct cache *m)
+{
+	m->lru_prev = list->lru_prev;
+	m->lru_next = list;
+	list->lru_prev->lru_next = m;
+	list->lru_prev = m;
+}
+
+
+/* Mappings taken out of the cache with the lock held, to be
+ * unmapped by bury() once it is dropped.
+ */
+#define MAX_DEAD	32
+
+struct dead {
+	int n;
+	struct {
+		unsigned char *mapped;
+		int len;
+	} map[MAX_DEAD];
+};
+
+
+static void bury(struct dead *dead)
+{
+	while(dead->n > 0) {
+		--dead->n;
+		munmap(dead->map[dead->n].mapped, dead->map[dead->n].len);
+	}
+}
+
+
+static void unmap_entry(struct cache *m, struct dead *dead)
+{
+	if(m->hashed)
+		hash_del(m);
+	if(m->mapped) {
+		if(dead->n < MAX_DEAD) {
+			dead->map[dead->n].mapped = m->mapped;
+			dead->map[dead->n].len = m->len;
+			++dead->n;
+		} else
+			munmap(m->mapped, m->len); // a big shrink, rare
+		m->mapped = NULL;
+		cache_bytes -= m->len;
+	}
+	if(m->queue == &a1in)
+		--n_a1in;
+	m->queue = NULL;
+}
+
+
+// The oldest entry on the queue that is not in use, or NULL
+static struct cache *oldest(struct cache *queue)
+{
+	struct cache *m;
+
+	for(m = queue->lru_next; m != queue; m = m->lru_next)
+		if(m->in_use == 0)
+			return m;
+
+	return NULL;
+}
+
+
+// The entry not in use that we would rather lose, or NULL
+static struct cache *victim(void)
+{
+	struct cache *m;
+
+	if(n_a1in > max_a1in && (m = oldest(&a1in)))
+		return m;
+	if((m = oldest(&am)))
+		return m;
+	return oldest(&a1in);
+}
+
+
+// Unmaps an entry that is not in use. The caller moves it.
+static void evict(struct cache *m, struct dead *dead)
+{
+	if(m->queue == &a1in)
+		ghost_add(m->dev, m->ino);
+	unmap_entry(m, dead);
+	++stats->cache_evictions;
+}
+
+
+// Unmap unused entries until we are within budget
+static void shrink(struct dead *dead)
+{
+	struct cache *m;
+
+	while(cache_bytes > budget && (m = victim())) {
+		lru_del(m);
+		evict(m, dead);
+		lru_add(&free_list, m);
+	}
+}
+
+
+static unsigned long max_budget(void)
+{
+	return mmap_cache_bytes ? mmap_cache_bytes : ULONG_MAX;
+}
+
+
+#ifdef __linux__
+/* The proc files are opened before the chroot. We prefer the memory
+ * pressure of our cgroup, since that is what the OOM killer will
+ * look at, and fall back to the system wide one.
+ */
+void mmap_pressure_init(void)
+{
+	char line[PATH_MAX], path[PATH_MAX + 64], *p;
+	FILE *fp;
+
+	if(mmap_cache_pressure > 0) {
+		if((fp = fopen("/proc/self/cgroup", "r"))) {
+			while(fgets(line, sizeof(line), fp))
+				if(strncmp(line, "0::", 3) == 0) {
+					if((p = strchr(line, '\n'))) *p = '\0';
+					sprintf(path, "/sys/fs/cgroup%s/memory.pressure", line + 3);
+					psi_fd = open(path, O_RDONLY);
+					break;
+				}
+			fclose(fp);
+		}
+		if(psi_fd < 0)
+			psi_fd = open("/proc/pressure/memory", O_RDONLY);
+		if(psi_fd < 0)
+			syslog(LOG_WARNING, "mmap cache: no memory pressure info");
+	}
+
+	// statm is per worker, so we open it later relative to /proc
+	if(mmap_cache_rss > 0 && (proc_fd = open("/proc", O_RDONLY)) < 0)
+		syslog(LOG_WARNING, "/proc: %m");
+}
+
+
+static int read_proc(int fd, char *buf, int len)
+{
+	int n = pread(fd, buf, len - 1, 0);
+
+	if(n < 0) return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+
+static int under_pressure(void)
+{
+	char buf[256], *p;
+	unsigned long rss;
+
+	// some avg10=1.23 avg60=...
+	if(psi_fd >= 0 && read_proc(psi_fd, buf, sizeof(buf)) > 0 &&
+	   (p = strstr(buf, "avg10=")) &&
+	   strtod(p + 6, NULL) >= mmap_cache_pressure)
+		return 1;
+
+	if(proc_fd >= 0) {
+		if(statm_fd < 0) {
+			sprintf(buf, "%d/statm", (int)getpid());
+			statm_fd = openat(proc_fd, buf, O_RDONLY);
+		}
+		// size resident ... in pages
+		if(statm_fd >= 0 && read_proc(statm_fd, buf, sizeof(buf)) > 0 &&
+		   sscanf(buf, "%*u %lu", &rss) == 1 &&
+		   rss * getpagesize() > mmap_cache_rss)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+// At most once a second. Called with the lock held.
+static void check_pressure(struct dead *dead)
+{
+	unsigned long max = max_budget();
+
+	if(now == last_check) return;
+	last_check = now;
+
+	if(under_pressure()) {
+		if(!pressured)
+			syslog(LOG_NOTICE, "mmap cache: memory pressure, shrinking");
+		pressured = 1;
+		budget = cache_bytes / 2;
+		shrink(dead);
+	} else {
+		pressured = 0;
+		if(budget < max)
+			budget = budget > max / 2 ? max : budget * 2 + (1 << 20);
+		if(budget > max)
+			budget = max;
+	}
+}
+#else
+void mmap_pressure_init(void) {}
+
+#define check_pressure(dead)
+#endif
 
 
 void mmap_init()
 {
+	unsigned size;
 	int i;
 
 	if(mmap_cache_size < max_conns) {
@@ -96,88 +465,251 @@ void mmap_init()
 		exit(1);
 	}
 
-	if((mmap_cache = calloc(mmap_cache_size, sizeof(struct cache))) == NULL) {
+	// Keep the chains short: at least two buckets per entry
+	for(size = 64; size < mmap_cache_size * 2; size <<= 1) ;
+	hash_mask = size - 1;
+
+	// The usual 2q tuning: a1in gets a quarter of the entries,
+	// a1out remembers half as many files as we can hold.
+	max_a1in = mmap_cache_size / 4;
+	a1out_size = mmap_cache_size / 2 + 1;
+
+	mmap_cache = calloc(mmap_cache_size, sizeof(struct cache));
+	hash = calloc(size, sizeof(struct cache *));
+	a1out = calloc(a1out_size, sizeof(struct ghost));
+	ghost_hash = calloc(size, sizeof(struct ghost *));
+	if(!mmap_cache || !hash || !a1out || !ghost_hash) {
 		syslog(LOG_ERR, "mmap_init: out of memory");
 		exit(1);
 	}
 
-	// this is hacky but it gets the lrus in order
+	free_list.lru_next = free_list.lru_prev = &free_list;
+	a1in.lru_next = a1in.lru_prev = &a1in;
+	am.lru_next = am.lru_prev = &am;
 	for(i = 0; i < mmap_cache_size; ++i)
-		mmap_cache[i].time = i;
+		lru_add(&free_list, &mmap_cache[i]);
+
+	budget = max_budget();
+}
+
+
+static struct cache *find(dev_t dev, ino_t ino)
+{
+	struct cache *m;
+
+	for(m = hash[hash_key(dev, ino)]; m; m = m->h_next)
+		if(m->ino == ino && m->dev == dev)
+			return m;
+
+	return NULL;
+}
+
+
+static unsigned char *use(struct connection *conn, struct cache *m)
+{
+	++m->in_use;
+	if(m->queue == &am) {
+		lru_del(m);
+		lru_add(&am, m);
+	}
+	conn->cache = m;
+	return m->mapped;
 }
 
 
+static unsigned char *hit(struct connection *conn, struct cache *m)
+{
+	++stats->cache_hits;
+	return use(conn, m);
+}
+
+
+/* For the selector cache: the mapping of the file sel resolved to,
+ * if it is still the same dev, ino, size and mtime. Like the rest of
+ * the entry this is trusted for selector-cache-ttl, there is no stat.
+ * NULL if it is not mapped.
+ */
+unsigned char *mmap_find(struct connection *conn, struct selector *sel)
+{
+	struct cache *m;
+	unsigned char *mapped = NULL;
+
+	CACHE_LOCK();
+	if((m = find(sel->dev, sel->ino)) &&
+	   m->mtime == sel->mtime && m->len == sel->size) {
+		mapped = hit(conn, m);
+		conn->len = m->len;
+	}
+	CACHE_UNLOCK();
+
+	return mapped;
+}
+
+
+// Unlinks a stale entry. If it is still being sent, mmap_release
+// will unmap it when the last user is done.
+static void drop_stale(struct cache *m, struct dead *dead)
+{
+	if(m->in_use)
+		hash_del(m); // stays on its queue until then
+	else {
+		lru_del(m);
+		unmap_entry(m, dead);
+		lru_add(&free_list, m);
+	}
+}
+
+
+/* A miss reserves a slot, maps the file without the lock, then takes
+ * the lock again to publish it. The slot is in use and on no list or
+ * hash chain meanwhile, so nobody else can touch it.
+ */
 unsigned char *mmap_get(struct connection *conn, int fd)
 {
-	int i;
-	struct cache *lru, *m;
-	time_t t = LONG_MAX;
+	struct cache *m, *old, *queue;
 	struct stat sbuf;
+	struct dead dead;
+	unsigned char *mapped;
 
 	if(fstat(fd, &sbuf)) {
 		perror("fstat");
 		return NULL;
 	}
 
-	lru = NULL;
-	for(i = 0, m = mmap_cache; i < mmap_cache_size; ++i, ++m)
-		if(sbuf.st_ino == m->ino) { // can we have a zero ino?
-			// match
-			if(sbuf.st_mtime != m->mtime) break;
-			m->in_use++;
-			time(&m->time);
-			return m->mapped;
-		} else if(m->in_use == 0) {
-			if(m->time < t) {
-				t = m->time;
-				lru = m;
-			}
+	dead.n = 0;
+
+	CACHE_LOCK();
+
+	check_pressure(&dead);
+
+	if((m = find(sbuf.st_dev, sbuf.st_ino))) {
+		if(m->mtime == sbuf.st_mtime && m->len == conn->len) {
+			mapped = hit(conn, m);
+			CACHE_UNLOCK();
+			bury(&dead);
+			return mapped;
 		}
+		drop_stale(m, &dead);
+	}
 
-	// no matches
+	// no match
 
-	if(lru == NULL) {
-		syslog(LOG_DEBUG, "REAL PROBLEMS: no lru!!!\n");
-		return NULL;
+	++stats->cache_misses;
+
+	queue = &am;
+	if(mmap_cache_policy == MMAP_2Q) {
+		if(ghost_del(sbuf.st_dev, sbuf.st_ino))
+			++stats->cache_ghost_hits;
+		else
+			queue = &a1in;
 	}
 
-	if(lru->mapped)
-		munmap(lru->mapped, lru->len);
+	if((m = free_list.lru_next) == &free_list) {
+		if((m = victim()) == NULL) {
+			CACHE_UNLOCK();
+			bury(&dead);
+			syslog(LOG_DEBUG, "REAL PROBLEMS: no lru!!!\n");
+			return NULL;
+		}
+		lru_del(m);
+		evict(m, &dead);
+	} else
+		lru_del(m);
+	m->in_use = 1;
+
+	CACHE_UNLOCK();
+
+	bury(&dead);
 
+	mapped = mmap(NULL, conn->len, PROT_READ, MAP_SHARED, fd, 0);
 
-	lru->mapped = mmap(NULL, conn->len, PROT_READ, MAP_SHARED, fd, 0);
-	if(lru->mapped == MAP_FAILED) {
+	CACHE_LOCK();
+
+	if(mapped == MAP_FAILED) {
+		m->in_use = 0;
+		lru_add(&free_list, m);
+		CACHE_UNLOCK();
 		syslog(LOG_DEBUG, "REAL PROBLEMS: mmap failed!!");
 		return NULL;
 	}
 
-	lru->ino = sbuf.st_ino;
-	lru->len = conn->len;
-	time(&lru->time);
-	lru->in_use = 1;
-	lru->mtime = sbuf.st_mtime;
+	// Someone else may have mapped it while we did
+	if((old = find(sbuf.st_dev, sbuf.st_ino))) {
+		if(old->mtime == sbuf.st_mtime && old->len == conn->len) {
+			m->in_use = 0;
+			lru_add(&free_list, m);
+			dead.map[dead.n].mapped = mapped;
+			dead.map[dead.n].len = conn->len;
+			++dead.n;
+			mapped = use(conn, old);
+			CACHE_UNLOCK();
+			bury(&dead);
+			return mapped;
+		}
+		drop_stale(old, &dead);
+	}
+
+	m->mapped = mapped;
+	cache_bytes += conn->len;
+	m->dev = sbuf.st_dev;
+	m->ino = sbuf.st_ino;
+	m->len = conn->len;
+	m->mtime = sbuf.st_mtime;
+	if((m->queue = queue) == &a1in)
+		++n_a1in;
+	lru_add(queue, m);
+	hash_add(m);
+	conn->cache = m;
+
+	if(cache_bytes > budget)
+		shrink(&dead);
+
+	CACHE_UNLOCK();
 
-	return lru->mapped;
+	bury(&dead);
+
+	return mapped;
 }
 
 
 void mmap_release(struct connection *conn)
 {
-	struct cache *m;
-	int i;
+	struct cache *m = conn->cache;
+	struct dead dead;
 
-	for(i = 0, m = mmap_cache; i < mmap_cache_size; ++i, ++m)
-		if(m->mapped == conn->buf) {
-			m->in_use--;
-			return;
-		}
+	if(m == NULL) {
+		syslog(LOG_DEBUG, "PROBLEMS: buffer not in cache\n");
+		return;
+	}
 
-	syslog(LOG_DEBUG, "PROBLEMS: buffer not in cache\n");
+	conn->cache = NULL;
+	dead.n = 0;
+
+	CACHE_LOCK();
+	// Stale or over budget, it goes now
+	if(--m->in_use == 0 && (!m->hashed || cache_bytes > budget)) {
+		lru_del(m);
+		if(m->hashed)
+			evict(m, &dead);
+		else
+			unmap_entry(m, &dead);
+		lru_add(&free_list, m);
+	}
+	CACHE_UNLOCK();
+
+	bury(&dead);
 }
 
 #else
 
 void mmap_init(void) {}
+void mmap_pressure_init(void) {}
+
+
+unsigned char *mmap_find(struct connection *conn, struct selector *sel)
+{
+	return NULL;
+}
 
 
 unsigned char *mmap_get(struct connection *conn, int fd)
@@ -201,7 +733,7 @@ unsigned char *mmap_get(struct connection *conn, int fd)
 void mmap_release(struct connection *conn)
 {
 	if(munmap(conn->buf, conn->mapped)) {
-		++bad_munmaps;
+		++stats->bad_munmaps;
 		syslog(LOG_ERR, "munmap %p %d", conn->buf, conn->mapped);
 	}
 }
@@ -0,0 +1,449 @@
+/*
+ * selector.c - selector resolution cache for the gofish gopher daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Remembers what a selector resolved to: the type, the file to open
+ * and its stat. Working that out can take an open, a stat, and a
+ * scan of the directory's .cache. An entry is trusted for
+ * selector-cache-ttl seconds and then resolved again.
+ *
+ * Like the mmap cache this is a fixed pool of entries, hashed on the
+ * selector, with the least recently used entry reused first.
+ *
+ * The resolving itself, smart_open, and open_selector and is_dir
+ * which put it in front of the cache, are at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gofish.h"
+
+
+struct sel_entry {
+	char *name;              // the key, path follows it
+	char *path;
+	unsigned hash;
+	time_t checked;          // when we last resolved it
+	struct selector sel;
+	struct sel_entry *h_next;
+	struct sel_entry *lru_next, *lru_prev;
+};
+
+static struct sel_entry *sel_cache;
+static struct sel_entry **hash;
+static unsigned hash_mask;
+static struct sel_entry lru; // list head, lru.lru_next is the oldest
+
+#ifdef THREADS
+static pthread_mutex_t sel_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SEL_LOCK()		pthread_mutex_lock(&sel_lock)
+#define SEL_UNLOCK()	pthread_mutex_unlock(&sel_lock)
+#else
+#define SEL_LOCK()
+#define SEL_UNLOCK()
+#endif
+
+
+// FNV-1a
+static unsigned hash_name(char *name)
+{
+	unsigned h = 2166136261U;
+
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+static void lru_del(struct sel_entry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+
+static void lru_add(struct sel_entry *e)
+{
+	e->lru_prev = lru.lru_prev;
+	e->lru_next = &lru;
+	lru.lru_prev->lru_next = e;
+	lru.lru_prev = e;
+}
+
+
+static void hash_del(struct sel_entry *e)
+{
+	struct sel_entry **p;
+
+	for(p = &hash[e->hash & hash_mask]; *p; p = &(*p)->h_next)
+		if(*p == e) {
+			*p = e->h_next;
+			break;
+		}
+	e->h_next = NULL;
+}
+
+
+static struct sel_entry *lookup(char *name, unsigned h)
+{
+	struct sel_entry *e;
+
+	for(e = hash[h & hash_mask]; e; e = e->h_next)
+		if(e->hash == h && strcmp(e->name, name) == 0)
+			return e;
+
+	return NULL;
+}
+
+
+void sel_init(void)
+{
+	unsigned size;
+	int i;
+
+	if(selector_cache_ttl <= 0 || selector_cache_size <= 0) {
+		selector_cache_ttl = 0;
+		return;
+	}
+
+	for(size = 64; size < selector_cache_size * 2; size <<= 1) ;
+	hash_mask = size - 1;
+
+	sel_cache = calloc(selector_cache_size, sizeof(struct sel_entry));
+	hash = calloc(size, sizeof(struct sel_entry *));
+	if(sel_cache == NULL || hash == NULL) {
+		syslog(LOG_ERR, "sel_init: out of memory");
+		exit(1);
+	}
+
+	lru.lru_next = lru.lru_prev = &lru;
+	for(i = 0; i < selector_cache_size; ++i)
+		lru_add(&sel_cache[i]);
+}
+
+
+/* Looks up a selector. Returns 1 and fills in sel if we have an entry
+ * that has not timed out. sel->path must hold MAX_LINE + 10.
+ */
+int sel_find(char *name, struct selector *sel)
+{
+	struct sel_entry *e;
+
+	// The names are relative to the vhost directory
+	if(selector_cache_ttl == 0 || virtual_hosts) return 0;
+
+	if(*name == '/') ++name;
+
+	SEL_LOCK();
+	if((e = lookup(name, hash_name(name))) == NULL ||
+	   now - e->checked >= selector_cache_ttl) {
+		SEL_UNLOCK();
+		return 0;
+	}
+
+	lru_del(e);
+	lru_add(e);
+
+	sel->type  = e->sel.type;
+	sel->isdir = e->sel.isdir;
+	sel->dev   = e->sel.dev;
+	sel->ino   = e->sel.ino;
+	sel->size  = e->sel.size;
+	sel->mtime = e->sel.mtime;
+	strcpy(sel->path, e->path);
+	SEL_UNLOCK();
+
+	return 1;
+}
+
+
+// Adds or refreshes the entry for name
+void sel_add(char *name, struct selector *sel)
+{
+	struct sel_entry *e;
+	unsigned h;
+	int nlen, plen;
+
+	if(selector_cache_ttl == 0 || virtual_hosts) return;
+
+	if(*name == '/') ++name;
+	h = hash_name(name);
+	nlen = strlen(name) + 1;
+	plen = strlen(sel->path) + 1;
+
+	SEL_LOCK();
+	if((e = lookup(name, h)) == NULL) {
+		e = lru.lru_next;
+		if(e->name) {
+			hash_del(e);
+			free(e->name);
+			e->name = NULL;
+		}
+
+		if((e->name = malloc(nlen + plen)) == NULL) {
+			SEL_UNLOCK();
+			return;
+		}
+		memcpy(e->name, name, nlen);
+		e->hash = h;
+		e->h_next = hash[h & hash_mask];
+		hash[h & hash_mask] = e;
+	} else if(strcmp(e->path, sel->path)) {
+		// Same selector, different file
+		char *new = realloc(e->name, nlen + plen);
+		if(new == NULL) {
+			hash_del(e);
+			free(e->name);
+			e->name = NULL;
+			SEL_UNLOCK();
+			return;
+		}
+		e->name = new;
+	}
+
+	e->path = e->name + nlen;
+	memcpy(e->path, sel->path, plen);
+	e->sel = *sel;
+	e->sel.path = NULL; // we keep our own
+	e->checked = now;
+
+	lru_del(e);
+	lru_add(e);
+	SEL_UNLOCK();
+}
+
+
+// This handles parsing the name and opening the file
+// We allow the following /?<selector>/<path> || nothing
+// Returns the selector type in `selector' and the file opened in
+// `path', which must hold MAX_LINE + 10.
+int smart_open(char *name, char *type, char *path)
+{
+	int fd, t;
+	struct stat sbuf;
+	char line[MAX_LINE + 10], *p;
+
+	if(*name == '/') ++name;
+
+	// This is worth optimizing
+	if(*name == '\0') {
+		*type = '1';
+		strcpy(path, ".cache");
+		return open(path, O_RDONLY);
+	}
+
+	// Fast path - type specified
+	if(*(name + 1) == '/') {
+		*type = *name;
+		name += 2;
+
+		switch(*type) {
+		case '0':
+		case '4':
+		case '5':
+		case '6':
+		case '9':
+		case 'g':
+		case 'h':
+		case 'I':
+			strcpy(path, name);
+			return open(name, O_RDONLY);
+		case '1':
+			strcpy(path, name);
+			p = path + strlen(path);
+			if(p > path && *(p - 1) != '/') *p++ = '/';
+			strcpy(p, ".cache");
+			return open(path, O_RDONLY);
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+#ifndef STRICT_GOPHER
+	// Regular path
+	if((fd = open(name, O_RDONLY)) < 0) return -1;
+
+	if(fstat(fd, &sbuf)) {
+		close(fd);
+		return -1;
+	}
+
+	strcpy(path, name);
+
+	if(S_ISDIR(sbuf.st_mode)) {
+		*type = '1';
+		close(fd);
+
+		p = path + strlen(path);
+		if(*(p - 1) != '/') *p++ = '/';
+		strcpy(p, ".cache");
+		return open(path, O_RDONLY);
+	}
+
+	if((p = strrchr(path, '/')))
+		sprintf(line, "%.*s.cache", (int)(p + 1 - path), path);
+	else
+		strcpy(line, ".cache");
+
+
+	// The type comes from the directory's menu
+	if((t = menu_type(line, name)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* This works well for robots.txt and favicon.ico */
+	*type = t ? t : '0'; // default
+	return fd;
+#endif
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+/* Opens the file for a selector, or for a plain path when we are an
+ * http server, and sets conn->len to its size. Resolved selectors
+ * are kept in the selector cache. On a hit with head set, or when
+ * the file is already in the mmap cache, there is nothing to open:
+ * *fd is -1 and for the latter conn->buf is set. Menus always come
+ * back in conn->buf from the menu cache. Returns -1 if the file
+ * could not be opened.
+ */
+int open_selector(struct connection *conn, char *name, char *type,
+				  int *fd, int head)
+{
+	struct selector sel;
+	struct stat sbuf;
+	char path[MAX_LINE + 10];
+
+	sel.path = path;
+
+	if(sel_find(name, &sel)) {
+		*type = sel.type;
+		if(sel.type == '1' && is_gopher) {
+			*fd = -1;
+			if((conn->buf = menu_find(conn, &sel)))
+				return 0;
+			if((*fd = open(path, O_RDONLY)) >= 0) {
+				if(fstat(*fd, &sbuf) == 0)
+					conn->buf = menu_get(conn, path, *fd, &sbuf);
+				close(*fd);
+				*fd = -1;
+				if(conn->buf) return 0;
+			}
+		} else {
+			conn->len = sel.size;
+			*fd = -1;
+			if(head) return 0;
+			if(!use_sendfile(conn->len) &&
+			   (conn->buf = mmap_find(conn, &sel)))
+				return 0;
+			// We have to open it anyway, so make sure the size is right
+			if((*fd = open(path, O_RDONLY)) >= 0) {
+				if(fstat(*fd, &sbuf) == 0) {
+					conn->len = sbuf.st_size;
+					return 0;
+				}
+				close(*fd);
+			}
+		}
+		// gone, look it up again
+	}
+
+	if(is_gopher)
+		*fd = smart_open(name, type, path);
+	else {
+		*type = '9';
+		strcpy(path, name);
+		*fd = open(name, O_RDONLY);
+	}
+	if(*fd < 0) return -1;
+
+	if(fstat(*fd, &sbuf)) {
+		close(*fd);
+		*fd = -1;
+		return -1;
+	}
+
+	conn->len = sbuf.st_size;
+	sel.type  = *type;
+	sel.isdir = *type == '1' || S_ISDIR(sbuf.st_mode);
+	sel.dev   = sbuf.st_dev;
+	sel.ino   = sbuf.st_ino;
+	sel.size  = sbuf.st_size;
+	sel.mtime = sbuf.st_mtime;
+	sel_add(name, &sel);
+
+	if(*type == '1' && is_gopher) {
+		conn->buf = menu_get(conn, path, *fd, &sbuf);
+		close(*fd);
+		*fd = -1;
+		return conn->buf ? 0 : -1;
+	}
+
+	if(head) {
+		close(*fd);
+		*fd = -1;
+	}
+
+	return 0;
+}
+
+
+// stat(2) for http, through the selector cache
+int is_dir(char *name)
+{
+	struct selector sel;
+	struct stat sbuf;
+	char path[MAX_LINE + 10];
+
+	sel.path = path;
+
+	if(sel_find(name, &sel))
+		return sel.isdir;
+
+	if(stat(name, &sbuf) == -1) return 0;
+
+	if(S_ISDIR(sbuf.st_mode)) {
+		// there is nothing to send, keep it out of open_selector's way
+		strcpy(path, name);
+		sel.type  = '1';
+		sel.isdir = 1;
+		sel.dev   = sbuf.st_dev;
+		sel.ino   = sbuf.st_ino;
+		sel.size  = sbuf.st_size;
+		sel.mtime = sbuf.st_mtime;
+		sel_add(name, &sel);
+	}
+
+	return S_ISDIR(sbuf.st_mode);
+}
@@ -33,8 +33,13 @@
 
 #include "gofish.h"
 
+#ifdef USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 /* We cannot define this anywhere else */
 static in_addr_t listen_addr = INADDR_ANY;
+static int reuse_port;
 
 
 void set_listen_address(char *addr)
@@ -43,6 +48,22 @@ void set_listen_address(char *addr)
 }
 
 
+// Let each worker bind its own socket to the port
+void set_reuseport(int on)
+{
+#ifdef SO_REUSEPORT
+	reuse_port = on;
+#else
+	if(on) printf("reuseport not supported\n");
+#endif
+}
+
+int is_reuseport(void)
+{
+	return reuse_port;
+}
+
+
 int listen_socket(int port)
 {
  	struct sockaddr_in sock_name;
@@ -58,6 +79,11 @@ int listen_socket(int port)
 
 	if(setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
 				  (char *)&optval, sizeof (optval)) == -1 ||
+#ifdef SO_REUSEPORT
+	   (reuse_port &&
+		setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+				   (char *)&optval, sizeof (optval)) == -1) ||
+#endif
 	   bind (s, (struct sockaddr *)&sock_name, sizeof(sock_name)) == -1 ||
 	   listen(s, GOPHER_BACKLOG) == -1) {
 		close(s);
@@ -70,6 +96,13 @@ int listen_socket(int port)
 		return -1;
 	}
 
+	/* Accepted sockets inherit this on Linux. The io_uring accept
+	 * does not go through accept_socket, so it relies on that.
+	 */
+	optval = 1;
+	if(setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)))
+		perror("setsockopt(TCP_NODELAY)"); // not fatal
+
 	return s;
 }
 
@@ -99,10 +132,44 @@ int accept_socket(int sock, unsigned *addr)
 }
 
 
+// For sockets we did not accept ourselves
+int peer_addr(int sock, unsigned *addr)
+{
+	struct sockaddr_in sock_name;
+	socklen_t addrlen = sizeof(sock_name);
+
+	if(getpeername(sock, (struct sockaddr *)&sock_name, &addrlen))
+		return -1;
+
+	*addr = htonl(sock_name.sin_addr.s_addr);
+	return 0;
+}
+
+
+/* While corked, partial frames are held until uncorked, so the
+ * headers and trailers go out in the same segments as the file.
+ */
+void set_cork(int sock, int on)
+{
+#ifdef TCP_CORK
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+
+#ifdef USE_SENDFILE
+// Send len bytes of fd from *offset. *offset is updated.
+int send_file(int sock, int fd, off_t *offset, unsigned len)
+{
+	return sendfile(sock, fd, offset, len);
+}
+#endif
+
+
 // network byte order
 char *ntoa(unsigned n)
 {
-	static char a[16];
+	static THREAD_LOCAL char a[16];
 
 	sprintf(a, "%d.%d.%d.%d",
 			(n >> 24) & 0xff,
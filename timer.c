@@ -0,0 +1,211 @@
+/*
+ * timer.c - connection timeouts for the gofish gopher daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A two level timer wheel with one second ticks. Level 0 holds the
+ * deadlines in the next 64 seconds, one slot per second. Level 1
+ * holds the rest, one slot per 64 seconds, and a slot is pushed down
+ * into level 0 when we reach it. Anything past the end of level 1 is
+ * parked in the last slot and re-filed when it comes around.
+ *
+ * Connections are linked into the slots directly, so setting,
+ * moving or cancelling a deadline is O(1) and expiring only touches
+ * the connections that are due. Each event loop has its own wheel.
+ */
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "gofish.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+
+struct wheel {
+	struct connection *slot[WHEEL_SIZE];
+	unsigned long long used; // bit per non-empty slot
+};
+
+static THREAD_LOCAL struct wheel wheel[2];
+static THREAD_LOCAL time_t wheel_time; // everything <= this has fired
+static THREAD_LOCAL long long now_ms;
+
+THREAD_LOCAL time_t now;
+
+
+static void unlink_conn(struct connection *conn)
+{
+	if(conn->t_prev)
+		conn->t_prev->t_next = conn->t_next;
+	else {
+		wheel[conn->t_level].slot[conn->t_slot] = conn->t_next;
+		if(conn->t_next == NULL)
+			wheel[conn->t_level].used &= ~(1ULL << conn->t_slot);
+	}
+	if(conn->t_next)
+		conn->t_next->t_prev = conn->t_prev;
+
+	conn->t_next = conn->t_prev = NULL;
+}
+
+
+static void link_conn(struct connection *conn)
+{
+	int level, slot;
+
+	// Due now only happens when pushing down, and we fire it next
+	if(conn->deadline < wheel_time)
+		conn->deadline = wheel_time;
+
+	if(conn->deadline - wheel_time < WHEEL_SIZE) {
+		level = 0;
+		slot = conn->deadline & WHEEL_MASK;
+	} else {
+		time_t block = conn->deadline >> WHEEL_BITS;
+		time_t last  = (wheel_time >> WHEEL_BITS) + WHEEL_SIZE - 1;
+
+		level = 1;
+		slot = (block < last ? block : last) & WHEEL_MASK;
+	}
+
+	conn->t_level = level;
+	conn->t_slot  = slot;
+	conn->t_prev  = NULL;
+	if((conn->t_next = wheel[level].slot[slot]))
+		conn->t_next->t_prev = conn;
+	wheel[level].slot[slot] = conn;
+	wheel[level].used |= 1ULL << slot;
+}
+
+
+// Sets the deadline to when seconds from now. 0 cancels it.
+void timer_set(struct connection *conn, int when)
+{
+	if(conn->deadline)
+		unlink_conn(conn);
+
+	if(when > 0) {
+		/* now is truncated, so round up: we fire between when and
+		 * when + 1 seconds from now, never early. Never file in the
+		 * past, we would not see it for a full turn.
+		 */
+		conn->deadline = now + when + 1;
+		if(conn->deadline <= wheel_time)
+			conn->deadline = wheel_time + 1;
+		link_conn(conn);
+	} else
+		conn->deadline = 0;
+}
+
+
+static void update_clock(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec;
+	now_ms = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+// Call before the loop starts
+void timer_init(void)
+{
+	update_clock();
+	wheel_time = now;
+}
+
+
+/* Updates the cached clock and calls expire for every connection
+ * whose deadline has passed. Call once per pass of the event loop.
+ */
+void timer_run(void (*expire)(struct connection *conn))
+{
+	struct connection *conn;
+	int slot;
+
+	update_clock();
+
+	while(wheel_time < now) {
+		++wheel_time;
+
+		// Nothing filed at all, just catch up
+		if(wheel[0].used == 0 && wheel[1].used == 0) {
+			wheel_time = now;
+			break;
+		}
+
+		// Starting a new block, push the level 1 slot down
+		if((wheel_time & WHEEL_MASK) == 0) {
+			slot = (wheel_time >> WHEEL_BITS) & WHEEL_MASK;
+			while((conn = wheel[1].slot[slot])) {
+				unlink_conn(conn);
+				link_conn(conn);
+			}
+		}
+
+		slot = wheel_time & WHEEL_MASK;
+		while((conn = wheel[0].slot[slot])) {
+			unlink_conn(conn);
+			conn->deadline = 0;
+			expire(conn);
+		}
+	}
+}
+
+
+// First set bit at or after start, going round. used must be non-zero.
+static int next_slot(unsigned long long used, int start)
+{
+	used = (used >> start) | (used << ((WHEEL_SIZE - start) & WHEEL_MASK));
+	return (start + __builtin_ctzll(used)) & WHEEL_MASK;
+}
+
+
+/* Returns the poll timeout in milliseconds: until the next deadline
+ * (or level 1 push down), or -1 if nothing is pending.
+ */
+int timer_next(void)
+{
+	time_t next = 0, t;
+	long long ms;
+	int slot;
+
+	if(wheel[0].used) {
+		slot = next_slot(wheel[0].used, (wheel_time + 1) & WHEEL_MASK);
+		next = wheel_time + 1 + ((slot - wheel_time - 1) & WHEEL_MASK);
+	}
+
+	if(wheel[1].used) {
+		time_t block = wheel_time >> WHEEL_BITS;
+
+		slot = next_slot(wheel[1].used, (block + 1) & WHEEL_MASK);
+		t = (block + 1 + ((slot - block - 1) & WHEEL_MASK)) << WHEEL_BITS;
+		if(next == 0 || t < next) next = t;
+	}
+
+	if(next == 0) return -1;
+
+	ms = (long long)next * 1000 - now_ms;
+	if(ms < 1) return 0;
+	if(ms > 24 * 60 * 60 * 1000) return 24 * 60 * 60 * 1000;
+	return (int)ms;
+}
@@ -0,0 +1,349 @@
+/*
+ * uring.c - io_uring support for the gofish gopher daemon
+ * Copyright (C) 2002 Sean MacLennan <seanm@seanm.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this project; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* All knowledge of io_uring is isolated to this file. We talk to the
+ * kernel directly rather than pulling in liburing.
+ */
+
+#include "gofish.h"
+
+#ifdef HAVE_IO_URING
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned to_submit;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+};
+
+// One ring per event loop
+static THREAD_LOCAL struct ring ring = { .fd = -1 };
+
+
+static int uring_enter(unsigned submit, unsigned wait, unsigned flags,
+					   void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags,
+				   arg, argsz);
+}
+
+
+void uring_exit(void)
+{
+	if(ring.fd == -1) return;
+
+	if(ring.sqes) munmap(ring.sqes, ring.sqes_size);
+	if(ring.cq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+	if(ring.sq_ptr) munmap(ring.sq_ptr, ring.sq_size);
+	close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+
+// Returns 0 on success, -1 if the kernel cannot give us a usable ring
+int uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned *array, i;
+
+	memset(&p, 0, sizeof(p));
+	if((ring.fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		ring.fd = -1;
+		return -1;
+	}
+
+	// We need timeouts on the wait (5.11)
+	if(!(p.features & IORING_FEAT_EXT_ARG)) {
+		uring_exit();
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if(ring.sq_ptr == MAP_FAILED) {
+		ring.sq_ptr = NULL;
+		uring_exit();
+		return -1;
+	}
+
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if(ring.cq_ptr == MAP_FAILED) {
+		ring.cq_ptr = NULL;
+		uring_exit();
+		return -1;
+	}
+
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		uring_exit();
+		return -1;
+	}
+
+	ring.sq_head = (void *)((char *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (void *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (void *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.cq_head = (void *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (void *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (void *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes    = (void *)((char *)ring.cq_ptr + p.cq_off.cqes);
+	ring.sq_entries = p.sq_entries;
+
+	// The sqes always go in order, so the index array is fixed
+	array = (void *)((char *)ring.sq_ptr + p.sq_off.array);
+	for(i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+
+	return 0;
+}
+
+
+/* Returns a zeroed sqe. If the submission queue is full we push
+ * what we have to the kernel first.
+ */
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring.sq_tail;
+	int n;
+
+	if(tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+		if((n = uring_enter(ring.to_submit, 0, 0, NULL, 0)) > 0)
+			ring.to_submit -= n;
+		if(tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+			return NULL;
+	}
+
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+
+static void put_sqe(void)
+{
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+	++ring.to_submit;
+}
+
+
+/* Queue a poll for events on fd. Nothing goes to the kernel until the
+ * next uring_wait, so a loop iteration costs one syscall.
+ */
+int uring_poll_add(int fd, unsigned events, unsigned long long data, int multi)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = get_sqe())) {
+		syslog(LOG_WARNING, "io_uring: submission queue full");
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = data;
+	put_sqe();
+
+	return 0;
+}
+
+
+// The completion of the remove itself comes back as URING_IGNORE
+int uring_poll_remove(unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = get_sqe())) {
+		syslog(LOG_WARNING, "io_uring: submission queue full");
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = URING_IGNORE;
+	put_sqe();
+
+	return 0;
+}
+
+
+/* Queue an accept on the listening socket. A multishot accept (5.19)
+ * posts every socket as it arrives until it fails or is cancelled.
+ * The sockets come back nonblocking, so there is no fcntl either.
+ */
+int uring_accept(int fd, unsigned long long data, int multi)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = get_sqe())) {
+		syslog(LOG_WARNING, "io_uring: submission queue full");
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = SOCK_NONBLOCK;
+#ifdef IORING_ACCEPT_MULTISHOT
+	if(multi) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+#endif
+	sqe->user_data = data;
+	put_sqe();
+
+	return 0;
+}
+
+
+/* Queue a read of whatever is already on fd. With MSG_DONTWAIT the
+ * kernel never parks it, it completes (maybe with -EAGAIN) in the
+ * submit. So buf is free again as soon as uring_submit returns.
+ */
+int uring_recv(int fd, void *buf, unsigned len, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = get_sqe())) {
+		syslog(LOG_WARNING, "io_uring: submission queue full");
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = data;
+	put_sqe();
+
+	return 0;
+}
+
+
+// Like uring_poll_remove, but for any request
+int uring_cancel(unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = get_sqe())) {
+		syslog(LOG_WARNING, "io_uring: submission queue full");
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = URING_IGNORE;
+	put_sqe();
+
+	return 0;
+}
+
+
+// Push what is queued to the kernel now, without waiting
+int uring_submit(void)
+{
+	int n;
+
+	if(ring.to_submit == 0) return 0;
+
+	if((n = uring_enter(ring.to_submit, 0, 0, NULL, 0)) < 0)
+		return -1;
+
+	ring.to_submit -= n;
+	return 0;
+}
+
+
+/* Submit everything queued and wait for at least one completion.
+ * Returns the number of completions ready, 0 on timeout, or -1 with
+ * errno set.
+ */
+int uring_wait(int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned ready;
+	int n;
+
+	memset(&arg, 0, sizeof(arg));
+	if(timeout >= 0) {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = (unsigned long)&ts;
+	}
+
+	n = uring_enter(ring.to_submit, 1,
+					IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+					&arg, sizeof(arg));
+
+	ready = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - *ring.cq_head;
+
+	if(n < 0) {
+		if(ready) return ready;
+		return errno == ETIME ? 0 : -1;
+	}
+
+	ring.to_submit -= n;
+	return ready;
+}
+
+
+/* Pops the next completion. more is set if a multishot request is
+ * still armed. Returns 0 when there are none left.
+ */
+int uring_next(unsigned long long *data, int *res, int *more)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *ring.cq_head;
+
+	if(head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	*data  = cqe->user_data;
+	*res   = cqe->res;
+	*more  = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+#endif /* HAVE_IO_URING */
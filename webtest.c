@@ -46,11 +46,6 @@
 #define HTTP_PORT	80
 #define GOPHER_PORT	70
 
-int connect_socket(int port, unsigned addr);
-unsigned gethostaddr(char *hostname);
-int http_reply(int sock, char *buf, int bufsize);
-int gopher_reply(int sock, char *buf, int size);
-
 
 int main(int argc, char *argv[])
 {
@@ -501,95 +496,3 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
-
-
-int gopher_reply(int sock, char *buf, int size)
-{
-	int n;
-	char *p, *e;
-
-	n = read(sock, buf, size - 1);
-	close(sock);
-
-	if(n <= 0) {
-		perror("read");
-		return -1;
-	}
-	buf[n] = '\0';
-
-	if(*buf == '3') {
-		if((p = strchr(buf, '['))) {
-			++p;
-			n = strtol(p, &e, 10);
-			if(*e == ']') return n;
-		}
-		// default
-		return 3;
-	}
-
-	return 0;
-}
-
-
-int http_reply(int sock, char *buf, int size)
-{
-	int n, status;
-
-	n = read(sock, buf, size - 1);
-	close(sock);
-
-	if(n <= 0) {
-		perror("read");
-		return -1;
-	}
-	buf[n] = '\0';
-
-	if(strncmp(buf, "HTTP/1.1 ", 9) &&
-	   strncmp(buf, "HTTP/1.0 ", 9)) {
-		printf("Bad status\n");
-		return -1;
-	}
-
-	status = strtol(buf + 9, 0, 10);
-
-	if(status < 100 || status >= 600) {
-		printf("Bad status %d\n", status);
-		return -1;
-	}
-
-	return status;
-}
-
-
-int connect_socket(int port, unsigned addr)
-{
-	struct sockaddr_in sock_name;
-	int sock;
-
-#undef socket
-	if((sock = socket (AF_INET, SOCK_STREAM, 0)) == -1)
-		return -1;
-
-	memset(&sock_name, 0, sizeof(sock_name));
-	sock_name.sin_family = AF_INET;
-	sock_name.sin_addr.s_addr = addr;
-	sock_name.sin_port = htons(port);
-
-	if(connect(sock, (struct sockaddr *)&sock_name, sizeof(sock_name))) {
-		close(sock);
-		return -1;
-	}
-
-	return sock;
-}
-
-
-unsigned gethostaddr(char *hostname)
-{
-	struct hostent *host;
-
-	if((host = gethostbyname(hostname)) == NULL)
-		return 0;
-
-	return *(unsigned *)host->h_addr_list[0];
-}